@@ -0,0 +1,155 @@
+/*
+ * ######################################################################################################################################
+ *                       C O N S U M P T I O N   E N G I N E
+ * ######################################################################################################################################
+ *
+ * Integer calculation of the power consumption from the time between two pulses, for one energy meter channel.
+ *
+ * One pulse is 1 / pulsePerkWh kWh, which is CONSUMPTION_MWUS_PER_KWH / pulsePerkWh milliwatt microseconds.
+ * The consumption in milliwatts is therefore:
+ *
+ *   CONSUMPTION_MWUS_PER_KWH / (pulsePerkWh * (interval + correction))
+ *
+ * which is calculated by one 64 bit integer division, rounded to the nearest milliwatt. Unlike the float formula used
+ * before, the result is exact for any interval. The divisor fits in 64 bit for any pulsePerkWh (16 bit) and intervals
+ * up till 8 years.
+ *
+ * The per channel constants are calculated by consumptionEngineInit(), which must be called whenever pulse_per_kWh or
+ * pulseTimeCorrection in the configuration has been changed.
+ *
+ * A power window (powerWindow_t) holds the latest intervals for a channel, up till POWER_WINDOW_MAX, and a running sum.
+ * The average consumption over the window is the energy of the pulses divided by the sum of the intervals, which is
+ * calculated in O(1) no matter the length of the window. A window length of 1 is the consumption of the latest interval.
+ *
+ * The code is plain C++ without any Arduino or ESP-IDF dependencies. It is tested on the host against the float
+ * formula by test/test_consumption_engine (pio test -e native).
+ *
+ * Usage:
+ *   consumptionEngine_t engine;
+ *   consumptionEngineInit( &engine, 1000, 25000);     // 1000 pulses per kWh, 25 ms correction
+ *
+ *   int64_t milliWatt = consumptionMilliWatt( &engine, pulseTime - previousPulseTime);
+ *
+ *   powerWindow_t window;
+ *   powerWindowInit( &window, 8);                      // Average over the latest 8 intervals
+ *   powerWindowAdd( &window, pulseTime - previousPulseTime);
+ *   int64_t averageMilliWatt = powerWindowMilliWatt( &engine, &window);
+ */
+#ifndef CONSUMPTION_ENGINE_H
+#define CONSUMPTION_ENGINE_H
+
+#include <stdint.h>
+
+#define CONSUMPTION_MWUS_PER_KWH 3600000000000000ULL     // 1 kWh = 1000 W * 3600 s = 3.6e15 mW * µs
+#define POWER_WINDOW_MAX 16                               // Maximum number of intervals in a power window
+
+struct consumptionEngine_t
+  {
+    uint64_t pulsePerkWh;       // Number of pulses per kWh. 0 disables the calculation.
+    int64_t  correction;        // Microseconds added to every interval. Used to calibrate the calculated consumption.
+  };
+
+static inline void consumptionEngineInit( consumptionEngine_t* engine, uint16_t pulsePerkWh, int64_t correction)
+{
+  engine->pulsePerkWh = pulsePerkWh;
+  engine->correction = correction;
+}
+
+struct powerWindow_t
+  {
+    int64_t interval[POWER_WINDOW_MAX];   // The latest intervals (microseconds). Oldest at index next, when the window is full.
+    int64_t sum;                          // Sum of the intervals in the window
+    uint8_t length;                       // Number of intervals to average over. 1 .. POWER_WINDOW_MAX
+    uint8_t count;                        // Number of intervals in the window. 0 .. length
+    uint8_t next;                         // Index for the next interval
+  };
+
+/*
+ * Returns the average consumption in milliwatts for count intervals, which add up to intervalSum microseconds.
+ * The correction is added to each interval. count must be less than 5000 to avoid overflow.
+ * Returns 0 if the corrected intervals are not positive, or pulses per kWh is not configured.
+ */
+static inline int64_t consumptionMilliWattAverage( const consumptionEngine_t* engine, int64_t intervalSum, uint32_t count)
+{
+  int64_t correctedSum = intervalSum + engine->correction * (int64_t)count;
+  if ( count == 0 || correctedSum <= 0 || engine->pulsePerkWh == 0)
+    return 0;
+
+  uint64_t divisor = engine->pulsePerkWh * (uint64_t)correctedSum;
+  return (int64_t)((CONSUMPTION_MWUS_PER_KWH * count + divisor / 2) / divisor);
+}
+
+/*
+ * Returns the consumption in milliwatts for an interval (microseconds) between two pulses.
+ */
+static inline int64_t consumptionMilliWatt( const consumptionEngine_t* engine, int64_t interval)
+{
+  return consumptionMilliWattAverage( engine, interval, 1);
+}
+
+/*
+ * Returns the shortest interval (microseconds) from a pulse, for which the consumption is at most milliWatt.
+ * As the next pulse has not arrived yet, the consumption since the latest pulse is at most the consumption for the time
+ * passed. This is used to schedule when the consumption has dropped to a certain level.
+ * Returns 0 if milliWatt is not positive, or pulses per kWh is not configured.
+ */
+static inline int64_t consumptionInterval( const consumptionEngine_t* engine, int64_t milliWatt)
+{
+  if ( milliWatt <= 0 || engine->pulsePerkWh == 0)
+    return 0;
+
+  uint64_t divisor = engine->pulsePerkWh * (uint64_t)milliWatt;
+  return (int64_t)((CONSUMPTION_MWUS_PER_KWH + divisor - 1) / divisor) - engine->correction;
+}
+
+/*
+ * Returns the consumption rounded to the nearest watt, as published to Home Assistant.
+ */
+static inline long consumptionWatt( const consumptionEngine_t* engine, int64_t interval)
+{
+  return (long)((consumptionMilliWatt( engine, interval) + 500) / 1000);
+}
+
+/*
+ * Set the length of the window and remove all intervals from it.
+ */
+static inline void powerWindowInit( powerWindow_t* window, uint8_t length)
+{
+  window->length = length < 1 ? 1 : (length > POWER_WINDOW_MAX ? POWER_WINDOW_MAX : length);
+  window->sum = 0;
+  window->count = 0;
+  window->next = 0;
+}
+
+/*
+ * Add an interval to the window. When the window is full, the oldest interval is replaced.
+ */
+static inline void powerWindowAdd( powerWindow_t* window, int64_t interval)
+{
+  if ( window->count == window->length)
+    window->sum -= window->interval[window->next];
+  else
+    window->count++;
+
+  window->interval[window->next] = interval;
+  window->sum += interval;
+  window->next = (window->next + 1) % window->length;
+}
+
+/*
+ * Returns the average consumption in milliwatts over the intervals in the window. 0 if the window is empty.
+ */
+static inline int64_t powerWindowMilliWatt( const consumptionEngine_t* engine, const powerWindow_t* window)
+{
+  return consumptionMilliWattAverage( engine, window->sum, window->count);
+}
+
+/*
+ * Returns the average consumption over the window rounded to the nearest watt.
+ */
+static inline long powerWindowWatt( const consumptionEngine_t* engine, const powerWindow_t* window)
+{
+  return (long)((powerWindowMilliWatt( engine, window) + 500) / 1000);
+}
+
+#endif
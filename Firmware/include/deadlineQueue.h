@@ -0,0 +1,158 @@
+/*
+ * ######################################################################################################################################
+ *                       D E A D L I N E   Q U E U E
+ * ######################################################################################################################################
+ *
+ * Min-heap holding at most one deadline (microsecond timestamp) per energy meter channel.
+ *
+ * The pulse task uses it to find the channels, which need attention at a certain time (the next estimated consumption,
+ * or the end of a count window), without checking every channel each time it wakes up. The earliest deadline is at the
+ * top of the heap, so the pulse task can sleep until then.
+ *
+ * position[] holds the index in the heap for each channel, so the deadline of a channel can be changed or removed in
+ * O(log n) without searching. DEADLINE_QUEUE_NONE marks a channel without a deadline.
+ *
+ * The code is plain C++ without any Arduino or ESP-IDF dependencies. It is tested on the host by test/test_deadline_queue
+ * (pio test -e native).
+ *
+ * Usage:
+ *   deadlineQueue_t queue;
+ *   deadlineQueueInit( &queue);
+ *   deadlineQueueSet( &queue, channel, timeStamp + 1000000);   // Due in a second. A deadline of 0 removes the channel.
+ *
+ *   uint8_t channel;
+ *   while ( deadlineQueuePop( &queue, now, &channel))
+ *     handle( channel);                                         // Removed from the queue. Set a new deadline if required.
+ *
+ *   int64_t next = deadlineQueueNext( &queue);                  // 0 if the queue is empty
+ */
+#ifndef DEADLINE_QUEUE_H
+#define DEADLINE_QUEUE_H
+
+#include <stdint.h>
+
+#define DEADLINE_QUEUE_MAX 32         // Maximum number of channels. At least MAX_NO_OF_CHANNELS.
+#define DEADLINE_QUEUE_NONE 0xFF      // Position of a channel without a deadline
+
+struct deadlineQueue_t
+  {
+    int64_t deadline[DEADLINE_QUEUE_MAX];   // Heap of deadlines. Earliest at index 0.
+    uint8_t channel[DEADLINE_QUEUE_MAX];    // Channel for each deadline in the heap
+    uint8_t position[DEADLINE_QUEUE_MAX];   // Index in the heap for each channel, or DEADLINE_QUEUE_NONE
+    uint8_t size;                           // Number of deadlines in the heap
+  };
+
+static inline void deadlineQueueInit( deadlineQueue_t* queue)
+{
+  queue->size = 0;
+  for ( uint8_t ii = 0; ii < DEADLINE_QUEUE_MAX; ii++)
+    queue->position[ii] = DEADLINE_QUEUE_NONE;
+}
+
+/*
+ * Swap two entries in the heap and update their positions.
+ */
+static inline void deadlineQueueSwap( deadlineQueue_t* queue, uint8_t a, uint8_t b)
+{
+  int64_t deadline = queue->deadline[a];
+  uint8_t channel = queue->channel[a];
+  queue->deadline[a] = queue->deadline[b];
+  queue->channel[a] = queue->channel[b];
+  queue->deadline[b] = deadline;
+  queue->channel[b] = channel;
+  queue->position[queue->channel[a]] = a;
+  queue->position[queue->channel[b]] = b;
+}
+
+/*
+ * Restore the heap order for the entry at index, which has been changed or moved.
+ */
+static inline void deadlineQueueRestore( deadlineQueue_t* queue, uint8_t index)
+{
+  while ( index > 0 && queue->deadline[index] < queue->deadline[(index - 1) / 2])
+  {
+    deadlineQueueSwap( queue, index, (index - 1) / 2);
+    index = (index - 1) / 2;
+  }
+
+  for (;;)
+  {
+    uint8_t earliest = index;
+    uint8_t left = 2 * index + 1;
+    uint8_t right = left + 1;
+    if ( left < queue->size && queue->deadline[left] < queue->deadline[earliest])
+      earliest = left;
+    if ( right < queue->size && queue->deadline[right] < queue->deadline[earliest])
+      earliest = right;
+    if ( earliest == index)
+      return;
+    deadlineQueueSwap( queue, index, earliest);
+    index = earliest;
+  }
+}
+
+/*
+ * Remove the deadline for a channel. Nothing happens if the channel has no deadline.
+ */
+static inline void deadlineQueueRemove( deadlineQueue_t* queue, uint8_t channel)
+{
+  uint8_t index = queue->position[channel];
+  if ( index == DEADLINE_QUEUE_NONE)
+    return;
+
+  queue->position[channel] = DEADLINE_QUEUE_NONE;
+  queue->size--;
+  if ( index == queue->size)
+    return;
+
+  // Move the last entry to the hole and restore the heap order from there.
+  queue->deadline[index] = queue->deadline[queue->size];
+  queue->channel[index] = queue->channel[queue->size];
+  queue->position[queue->channel[index]] = index;
+  deadlineQueueRestore( queue, index);
+}
+
+/*
+ * Set, change or remove (deadline = 0) the deadline for a channel.
+ */
+static inline void deadlineQueueSet( deadlineQueue_t* queue, uint8_t channel, int64_t deadline)
+{
+  if ( deadline == 0)
+  {
+    deadlineQueueRemove( queue, channel);
+    return;
+  }
+
+  uint8_t index = queue->position[channel];
+  if ( index == DEADLINE_QUEUE_NONE)
+  {
+    index = queue->size++;
+    queue->channel[index] = channel;
+    queue->position[channel] = index;
+  }
+  queue->deadline[index] = deadline;
+  deadlineQueueRestore( queue, index);
+}
+
+/*
+ * Returns the earliest deadline, or 0 if the queue is empty.
+ */
+static inline int64_t deadlineQueueNext( const deadlineQueue_t* queue)
+{
+  return queue->size > 0 ? queue->deadline[0] : 0;
+}
+
+/*
+ * If the earliest deadline is at or before timeStamp, remove it, return the channel in *channel and return true.
+ */
+static inline bool deadlineQueuePop( deadlineQueue_t* queue, int64_t timeStamp, uint8_t* channel)
+{
+  if ( queue->size == 0 || queue->deadline[0] > timeStamp)
+    return false;
+
+  *channel = queue->channel[0];
+  deadlineQueueRemove( queue, *channel);
+  return true;
+}
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * ######################################################################################################################################
+ *                       M I N U T E   A G G R E G A T E
+ * ######################################################################################################################################
+ *
+ * Incremental aggregate of the pulses and consumptions for one energy meter channel over one minute.
+ *
+ * Every pulse is added by minuteAggregateAddPulse(), and every consumption calculated (from a pulse interval, a count
+ * window or an estimate) by minuteAggregateAddPower(). Only counters and the minimum and maximum are updated, so
+ * the cost per pulse is constant and no pulses are stored.
+ *
+ * At the end of the minute the energy and average consumption are calculated from the number of pulses, and the
+ * aggregate is reset for the next minute. The average is the energy divided by the length of the minute, so it does
+ * not depend on how the consumptions were sampled. The minimum and maximum are widened to include the average, which
+ * also covers a minute without any consumption calculated.
+ *
+ * The code is plain C++ without any Arduino or ESP-IDF dependencies. It is tested on the host by test/test_minute_aggregate
+ * (pio test -e native).
+ *
+ * Usage:
+ *   minuteAggregate_t minute;
+ *   minuteAggregateReset( &minute);
+ *
+ *   // For every pulse:
+ *   minuteAggregateAddPulse( &minute);
+ *   minuteAggregateAddPower( &minute, watt);
+ *
+ *   // At the end of the minute:
+ *   uint64_t milliWh = minuteAggregateMilliWh( &minute, 1000);                       // 1000 pulses per kWh
+ *   long averageWatt = minuteAggregateAverageWatt( &minute, 1000, minuteLength);     // Length in microseconds
+ *   minuteAggregateReset( &minute);
+ */
+#ifndef MINUTE_AGGREGATE_H
+#define MINUTE_AGGREGATE_H
+
+#include <stdint.h>
+#include <consumptionEngine.h>
+
+struct minuteAggregate_t
+  {
+    uint32_t pulses;            // Number of pulses in the minute
+    uint32_t samples;           // Number of consumptions added in the minute
+    long     minWatt;           // Minimum consumption added. Valid when samples > 0.
+    long     maxWatt;           // Maximum consumption added. Valid when samples > 0.
+  };
+
+static inline void minuteAggregateReset( minuteAggregate_t* minute)
+{
+  minute->pulses = 0;
+  minute->samples = 0;
+  minute->minWatt = 0;
+  minute->maxWatt = 0;
+}
+
+static inline void minuteAggregateAddPulse( minuteAggregate_t* minute)
+{
+  minute->pulses++;
+}
+
+static inline void minuteAggregateAddPower( minuteAggregate_t* minute, long watt)
+{
+  if ( minute->samples == 0 || watt < minute->minWatt)
+    minute->minWatt = watt;
+  if ( minute->samples == 0 || watt > minute->maxWatt)
+    minute->maxWatt = watt;
+  minute->samples++;
+}
+
+/*
+ * Returns the energy of the pulses in milliwatt hours, rounded to the nearest. 0 if pulses per kWh is not configured.
+ */
+static inline uint64_t minuteAggregateMilliWh( const minuteAggregate_t* minute, uint16_t pulsePerkWh)
+{
+  if ( pulsePerkWh == 0)
+    return 0;
+  return ((uint64_t)minute->pulses * 1000000 + pulsePerkWh / 2) / pulsePerkWh;
+}
+
+/*
+ * Returns the average consumption in watts over length microseconds, rounded to the nearest.
+ * 0 if length is not positive or pulses per kWh is not configured.
+ */
+static inline long minuteAggregateAverageWatt( const minuteAggregate_t* minute, uint16_t pulsePerkWh, int64_t length)
+{
+  if ( length <= 0 || pulsePerkWh == 0)
+    return 0;
+
+  // Energy in milliwatt microseconds divided by the length. Fits in 64 bit up till 5000 kWh per minute.
+  uint64_t energy = (uint64_t)minute->pulses * (CONSUMPTION_MWUS_PER_KWH / pulsePerkWh);
+  return (long)((energy / (uint64_t)length + 500) / 1000);
+}
+
+static inline long minuteAggregateMinWatt( const minuteAggregate_t* minute, long averageWatt)
+{
+  return minute->samples > 0 && minute->minWatt < averageWatt ? minute->minWatt : averageWatt;
+}
+
+static inline long minuteAggregateMaxWatt( const minuteAggregate_t* minute, long averageWatt)
+{
+  return minute->samples > 0 && minute->maxWatt > averageWatt ? minute->maxWatt : averageWatt;
+}
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * ######################################################################################################################################
+ *                       P U L S E   S A M P L E R
+ * ######################################################################################################################################
+ *
+ * Debounce state machine for one energy meter channel, used by the timer driven sampling capture backend (CAPTURE_SAMPLER).
+ *
+ * The GPIO level of the channel is sampled at a fixed rate, and each sample is passed to pulseSamplerUpdate().
+ * An integrator counts up for every HIGH sample and down for every LOW sample, limited to 0 .. threshold.
+ * The debounced level changes to HIGH when the integrator reaches threshold, and to LOW when it reaches 0.
+ * Noise shorter than threshold samples will therefore never change the debounced level.
+ *
+ * A debounced rising edge is the beginning of a pulse, and a debounced falling edge the end.
+ * At the falling edge the pulse width (in samples) is validated against minWidth .. maxWidth.
+ * If maxWidth is 0, the validation is disabled and the pulse is reported at the rising edge.
+ *
+ * The code is plain C++ without any Arduino or ESP-IDF dependencies. It is tested on the host by feeding it synthetic
+ * waveforms in test/test_pulse_sampler (pio test -e native).
+ *
+ * Usage:
+ *   pulseSampler_t sampler;
+ *   pulseSamplerInit( &sampler, 5, 25, 150);           // 5 samples debounce, 25 .. 150 samples wide pulses
+ *
+ *   // For every sample:
+ *   if ( pulseSamplerUpdate( &sampler, level, sampleCount) == SAMPLER_PULSE)
+ *     registerPulse( sampler.riseSample);              // Sample count at the debounced rising edge
+ */
+#ifndef PULSE_SAMPLER_H
+#define PULSE_SAMPLER_H
+
+#include <stdint.h>
+
+#define SAMPLER_NO_PULSE  0     // Nothing to report
+#define SAMPLER_PULSE     1     // A valid pulse has been detected. It started at riseSample.
+#define SAMPLER_REJECTED  2     // A pulse has been detected, but the width was outside minWidth .. maxWidth.
+
+struct pulseSampler_t
+  {
+    uint8_t  integrator;        // 0 .. threshold
+    uint8_t  threshold;         // Number of samples required to change the debounced level
+    bool     level;             // Debounced level
+    uint32_t riseSample;        // Sample count at the latest debounced rising edge
+    uint32_t minWidth;          // Minimum accepted pulse width in samples
+    uint32_t maxWidth;          // Maximum accepted pulse width in samples. 0 disables the validation.
+  };
+
+static inline void pulseSamplerInit( pulseSampler_t* sampler, uint8_t threshold, uint32_t minWidth, uint32_t maxWidth)
+{
+  sampler->integrator = 0;
+  sampler->threshold = threshold > 0 ? threshold : 1;
+  sampler->level = false;
+  sampler->riseSample = 0;
+  sampler->minWidth = minWidth;
+  sampler->maxWidth = maxWidth;
+}
+
+/*
+ * Feed one sample to the state machine. sampleCount is a free running counter incremented for every sample.
+ * Returns SAMPLER_NO_PULSE, SAMPLER_PULSE or SAMPLER_REJECTED.
+ * Inlined, as it is called from the sampling ISR for every channel.
+ */
+static inline __attribute__((always_inline)) uint8_t pulseSamplerUpdate( pulseSampler_t* sampler, bool input, uint32_t sampleCount)
+{
+  if ( input)
+  {
+    if ( sampler->integrator < sampler->threshold)
+      sampler->integrator++;
+  }
+  else if ( sampler->integrator > 0)
+  {
+    sampler->integrator--;
+  }
+
+  if ( !sampler->level && sampler->integrator >= sampler->threshold)
+  {
+    // Debounced rising edge. The first HIGH sample of the pulse was threshold - 1 samples ago.
+    sampler->level = true;
+    sampler->riseSample = sampleCount - sampler->threshold + 1;
+    if ( sampler->maxWidth == 0)
+      return SAMPLER_PULSE;
+  }
+  else if ( sampler->level && sampler->integrator == 0)
+  {
+    // Debounced falling edge. Both edges are delayed threshold samples, so the difference is the pulse width.
+    sampler->level = false;
+    if ( sampler->maxWidth == 0)
+      return SAMPLER_NO_PULSE;
+
+    uint32_t pulseWidth = sampleCount - sampler->threshold + 1 - sampler->riseSample;
+    if ( pulseWidth >= sampler->minWidth && pulseWidth <= sampler->maxWidth)
+      return SAMPLER_PULSE;
+    else
+      return SAMPLER_REJECTED;
+  }
+  return SAMPLER_NO_PULSE;
+}
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * ######################################################################################################################################
+ *                       S T E P   D E T E C T O R
+ * ######################################################################################################################################
+ *
+ * Change point detection on the pulse intervals of one energy meter channel, used to detect appliances switching on or off.
+ *
+ * The consumption is inversely proportional to the pulse interval, so a step in consumption is a step in the logarithm
+ * of the interval of the same size, no matter the level. A two sided CUSUM is run on x = ln(interval):
+ *
+ *   high = max(0, high + x - level - drift)      // Intervals longer than the level: consumption stepped down
+ *   low  = max(0, low + level - x - drift)       // Intervals shorter than the level: consumption stepped up
+ *
+ * drift is half the smallest step (as a ratio) to detect, and a step is detected when one of the sums exceeds threshold.
+ * The new level is the average of x since the sum started to grow, so the step is estimated from those pulses only.
+ * Without a step the level follows x slowly (STEP_LEVEL_WEIGHT), so slow changes are not reported as steps.
+ *
+ * Single precision floats are used, as the ESP32 has a floating point unit. One logf() per pulse.
+ *
+ * The code is plain C++ without any Arduino or ESP-IDF dependencies. It is tested on the host by test/test_step_detector
+ * (pio test -e native).
+ *
+ * Usage:
+ *   stepDetector_t detector;
+ *   stepDetectorInit( &detector, 20, 3);              // Steps of 20 % and more, threshold 3 times the drift
+ *
+ *   // For every pulse interval (microseconds):
+ *   int64_t before, after;
+ *   if ( stepDetectorUpdate( &detector, interval, &before, &after) != STEP_NONE)
+ *     report( before, after);                         // Typical interval before and after the step
+ */
+#ifndef STEP_DETECTOR_H
+#define STEP_DETECTOR_H
+
+#include <stdint.h>
+#include <math.h>
+
+#define STEP_NONE  0     // No step detected
+#define STEP_UP    1     // The consumption has stepped up (shorter intervals)
+#define STEP_DOWN  2     // The consumption has stepped down (longer intervals)
+
+#define STEP_LEVEL_WEIGHT 0.125f     // Weight of a new interval in the level, when no step is building up
+#define STEP_WARMUP 2                // Number of intervals used to set the first level
+
+struct stepDetector_t
+  {
+    float    level;             // Current level of ln(interval)
+    float    drift;             // Half the smallest step to detect, as ln(ratio)
+    float    threshold;         // A step is detected, when a sum exceeds this
+    float    high;              // CUSUM for longer intervals
+    float    low;               // CUSUM for shorter intervals
+    float    highSum;           // Sum of x since high started to grow
+    float    lowSum;            // Sum of x since low started to grow
+    uint16_t highCount;         // Number of intervals in highSum
+    uint16_t lowCount;          // Number of intervals in lowSum
+    uint8_t  samples;           // Number of intervals in the level. Up till STEP_WARMUP.
+  };
+
+/*
+ * Reset the detector. Steps of minStepPercent and more are detected, when the sum exceeds thresholdFactor times the drift.
+ */
+static inline void stepDetectorInit( stepDetector_t* detector, uint8_t minStepPercent, uint8_t thresholdFactor)
+{
+  detector->drift = logf( 1.0f + minStepPercent / 100.0f) / 2;
+  detector->threshold = detector->drift * thresholdFactor;
+  detector->level = 0;
+  detector->high = 0;
+  detector->low = 0;
+  detector->highSum = 0;
+  detector->lowSum = 0;
+  detector->highCount = 0;
+  detector->lowCount = 0;
+  detector->samples = 0;
+}
+
+/*
+ * Feed one pulse interval (microseconds). Returns STEP_NONE, STEP_UP or STEP_DOWN.
+ * When a step is detected, *before and *after are the typical intervals before and after the step.
+ */
+static inline uint8_t stepDetectorUpdate( stepDetector_t* detector, int64_t interval, int64_t* before, int64_t* after)
+{
+  if ( interval <= 0)
+    return STEP_NONE;
+
+  float x = logf( (float)interval);
+  if ( detector->samples < STEP_WARMUP)
+  {
+    detector->samples++;
+    detector->level += ( x - detector->level) / detector->samples;
+    return STEP_NONE;
+  }
+
+  // Two sided CUSUM. The sums for the new level are restarted, whenever a CUSUM returns to 0.
+  detector->high += x - detector->level - detector->drift;
+  if ( detector->high <= 0)
+  {
+    detector->high = 0;
+    detector->highSum = 0;
+    detector->highCount = 0;
+  }
+  else
+  {
+    detector->highSum += x;
+    detector->highCount++;
+  }
+
+  detector->low += detector->level - x - detector->drift;
+  if ( detector->low <= 0)
+  {
+    detector->low = 0;
+    detector->lowSum = 0;
+    detector->lowCount = 0;
+  }
+  else
+  {
+    detector->lowSum += x;
+    detector->lowCount++;
+  }
+
+  uint8_t step = STEP_NONE;
+  float newLevel = 0;
+  if ( detector->high > detector->threshold)
+  {
+    step = STEP_DOWN;
+    newLevel = detector->highSum / detector->highCount;
+  }
+  else if ( detector->low > detector->threshold)
+  {
+    step = STEP_UP;
+    newLevel = detector->lowSum / detector->lowCount;
+  }
+
+  if ( step == STEP_NONE)
+  {
+    // Follow slow changes, but not while a step is building up.
+    if ( detector->high == 0 && detector->low == 0)
+      detector->level += ( x - detector->level) * STEP_LEVEL_WEIGHT;
+    return STEP_NONE;
+  }
+
+  *before = (int64_t)expf( detector->level);
+  *after = (int64_t)expf( newLevel);
+  detector->level = newLevel;
+  detector->high = 0;
+  detector->low = 0;
+  detector->highSum = 0;
+  detector->lowSum = 0;
+  detector->highCount = 0;
+  detector->lowCount = 0;
+  return step;
+}
+
+#endif
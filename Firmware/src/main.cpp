@@ -10,11 +10,18 @@
 #include "SD.h"
 #include "SPI.h"
 #include "time.h"
+#include "driver/pcnt.h"
+#include "soc/gpio_struct.h"
+#include <pulseSampler.h>
+#include <consumptionEngine.h>
+#include <deadlineQueue.h>
+#include <minuteAggregate.h>
+#include <stepDetector.h>
 
-#define SKETCH_VERSION "Esp32 MQTT interface for Carlo Gavazzi energy meter - V4.2.0"
+#define SKETCH_VERSION "Esp32 MQTT interface for Carlo Gavazzi energy meter - V5.0.0"
 
 /*
- * This is an Esp32 MQTT interface for up till eight Carlo Gavazzi energy meters type
+ * This is an Esp32 MQTT interface for up till 24 Carlo Gavazzi energy meters type
  * EM23 DIN and Type EM111.
  * 
  * The interface will publish data to Home Assistant (HA) and Google sheets (GS).
@@ -49,7 +56,7 @@
  * )** pulse-counts in the number of pulses counted by the energy meter. It is calculated by the kWh,
  * shown on the energy meter multiplied be the number of pulses per kWh for the energy meter. 
  *  Pulses per kWh can be found in the documentation for the energy meter.
- * )*** ‘Energy meter number’ is a number 0..7 for the channel, on which the energy meter is connected.
+ * )*** ‘Energy meter number’ is a number 0..(PRIVATE_NO_OF_CHANNELS - 1) for the channel, on which the energy meter is connected.
  * The relation between energy meter and channel number is defined in the privateConfig.h file. 
  */ 
 
@@ -90,6 +97,72 @@
  *         - Issue: "Forbrug" is published as 0 (zero) #9
  * 4.2.0    Enhancements:
  *        - Issue: Stop running when SC card fails #3
+ * 5.0.0    Enhancements:
+ *        - Pulses are no longer merged while loop() is blocked. The ISR stores every pulse timestamp in a ring buffer per channel,
+ *          which is drained by loop(). Pulses arriving while the ring buffer is full are counted in pulseRingOverflow[].
+ *        - Pulses can be counted by the ESP32 pulse counter (PCNT) peripheral instead of an interrupt per pulse.
+ *          Select the backend with PRIVATE_CAPTURE_BACKEND in privateConfig.h.
+ *        - Pulse timestamps are 64 bit microseconds from esp_timer_get_time() instead of millis(). The special cases
+ *          handling millis() overrun has been removed, and the consumption is calculated with microsecond resolution.
+ *        - Up till MAX_NO_OF_CHANNELS (24) energy meters. GPIO pins are defined in the table PRIVATE_CHANNEL_PINS in privateConfig.h
+ *          and one common ISR is attached to all channels by attachInterruptArg().
+ *        - The ISR captures both edges and accepts a pulse only if its width is within the window defined for the channel
+ *          in privateConfig.h. Rejected pulses are counted and published to the diagnostics topic.
+ *        - Plausibility hold-off. A minimum time between pulses is calculated from the maximum power of each energy meter
+ *          defined in privateConfig.h. Pulses arriving faster are dropped by the capture path and counted as implausible.
+ *        - Timer driven sampling capture backend (CAPTURE_SAMPLER). A hardware timer samples all channel GPIO's and a debounce 
+ *          state machine per channel (include/pulseSampler.h) detects and validates the pulses.
+ *        - Interrupt storm protection. A channel with an IRQ rate above a physical limit (e.g. a disconnected or chattering line)
+ *          is masked and its interrupt detached. It is re-attached after a backoff time, which is doubled for every new storm.
+ *          The fault state is published to the diagnostics topic.
+ *        - Lost pulse accounting. Pulses accepted by the capture layer (rawPulses[]) are compared with pulses counted in 
+ *          meterData[] (processedPulses[]). The difference is published as lost pulses, and can be added to the totals
+ *          by setting PRIVATE_RECONCILE_LOST_PULSES in privateConfig.h.
+ *        - Dedicated pulse task. Pulses are processed, counted and written to the SD card by a task pinned to core 0,
+ *          while loop() handles WiFi, MQTT, OTA and Google Sheets on core 1. The pulse task passes values to be published
+ *          to loop() through a bounded queue, so a blocking network call never delays the pulse processing.
+ *        - Latency instrumentation. The time from a pulse is stored by the ISR until its consumption is published, and until
+ *          it has been written to the SD card, is counted in log2 histograms per channel and published to the latency topic.
+ *        - The consumption is calculated by an integer engine (include/consumptionEngine.h) with exact rounding to the nearest
+ *          milliwatt, instead of float divisions. The constants per channel are calculated when the configuration changes.
+ *        - The published consumption can be averaged over the latest N pulse intervals per channel (sliding window with a
+ *          running sum). N is configured per channel through the MQTT config topic. A deadband (PRIVATE_POWER_DEADBAND_W)
+ *          suppresses publishing of small changes, but values are still published at least every POWER_MAX_PUBLISH_INTERVAL.
+ *          The configuration file is extended, and a configuration from the previous version is kept.
+ *        - Count mode for high pulse rates. Above PRIVATE_COUNT_MODE_RATE pulses per second a channel switches from a
+ *          consumption per pulse interval to counting pulses over COUNT_MODE_WINDOW. Totals are written to SD and published
+ *          once per window instead of for every pulse. The channel switches back below half the rate.
+ *        - When pulses stop arriving, the consumption is no longer published as a negative "fictive" value based on doubling
+ *          the pulse time. As the next pulse has not arrived, the consumption is at most one pulse over the time since the 
+ *          latest pulse. This upper bound is published as a positive, never increasing value with "Estimated" set to true,
+ *          each time it has dropped to DECAY_RATIO percent of the previous value.
+ *        - The pulse task keeps the next deadline (estimated consumption or end of count window) for each channel in a 
+ *          min-heap, and sleeps until the earliest deadline instead of checking all channels every PULSE_TASK_PERIOD.
+ *          Only channels with a deadline passed are handled. HA configurations are only checked while some are unpublished.
+ *        - Per minute aggregates for each channel (energy, minimum, average and maximum consumption and number of pulses)
+ *          are updated for every pulse and published as one message per minute and channel.
+ *        - 15 minute demand registers for each channel, aligned to NTP time: Energy in the current window, demand of the 
+ *          previous window and the maximum demand today and this month. The registers are stored in the data files, which 
+ *          are extended. A data file from the previous version is read, and the totals are kept. The registers are 
+ *          published as extra HA entities. publishMqttEnergyConfigJson() takes the state topic suffix as parameter.
+ *        - Time of use tariff registers. A table in privateConfig.h gives the tariff for each hour of the week, and every
+ *          pulse is counted in the register of the tariff at the time of the pulse. The registers are stored in the data
+ *          files, and published with the state and to Google sheets, when more than one tariff is defined.
+ *          Fields added to the data files are cleared, when a data file written by a previous version is read.
+ *        - Virtual meters defined in privateConfig.h as linear combinations of the energy meters (e.g. main meter minus 
+ *          sub meters). They are evaluated, when a contributing energy meter publishes, and published to HA as 
+ *          energy meter PRIVATE_NO_OF_CHANNELS and up. Their totals are calculated from the stored counters.
+ *        - Sub meter reconciliation. The energy of a parent energy meter is compared with the sum of its sub meters over
+ *          a rolling window, calculated from the totals every SUBMETER_INTERVAL. The unexplained difference is published, 
+ *          and an alert is raised, when it exceeds PRIVATE_SUBMETER_ALERT_PERCENT of the parent.
+ *        - Baseload for each channel: The lowest 15 minute demand within the last 24 hours, kept as the minimum for each 
+ *          hour, so it is updated once per demand window. Published with the demand registers and as an HA entity.
+ *        - Step detection. A CUSUM on the logarithm of the pulse intervals detects appliances switching on and off, and 
+ *          each step is published as a compact event, as soon as the pulses show it. Enabled per channel in privateConfig.h.
+ *        - Forecast of the energy used by the end of the day and month for each channel. The rest of the period is expected 
+ *          to follow an hourly profile learned from the previous days. Published with the demand registers and as HA entities.
+ *        - Load duration histogram for each channel: The time with a consumption within each of 32 half octave bins. Updated
+ *          on every pulse interval, count window and estimated consumption, and published and reset with the subtotals.
  *          
  * Boot analysis:
  * Esp32 MQTT interface for Carlo Gavazzi energy meter - V2.0.0
@@ -144,7 +217,7 @@
  */
 
 
-#define CONFIGURATON_VERSION 5
+#define CONFIGURATON_VERSION 6
 /* WiFi and MQTT connect attempt issues. 
  * IRQ's will be registrated, but the counters for will not be updated during the calls to WiFi and MQTT connect. If more than one pulse
  * from then same meter arrives, it will be lost if these calls takes up too much time. Setting a long connect postpone will reduce the loss
@@ -154,11 +227,110 @@
 #define MQTT_CONNECT_POSTPONE 30        // Number of seconds between MQTT connect dattempts, when MQTT connect fails to connect.
 #define BLIP 100                        // Time in milliseconds the LED will blink
 #define MIN_CONSUMPTION 25              // Define the minimum powerconsumption published before publishing 0
-                                        // See '>>>    Pulse time check  <<<' in the last part of the loop() for further details.
+                                        // See checkPulseTime() for further details.
+#define DECAY_RATIO 50                  // Percent. An estimated consumption is published, when it has dropped to this part of the previous.
+#ifndef PRIVATE_POWER_WINDOW
+#define PRIVATE_POWER_WINDOW 1          // Default number of pulse intervals the published consumption is averaged over. 1 = latest interval.
+#endif
+#ifndef PRIVATE_POWER_DEADBAND_W
+#define PRIVATE_POWER_DEADBAND_W 0      // Consumption changes smaller than this (Watt) are not published. 0 = publish every change.
+#endif
+#define POWER_MAX_PUBLISH_INTERVAL 60   // Maximum number of seconds a consumption is held back by the deadband.
+#ifndef PRIVATE_COUNT_MODE_RATE
+#define PRIVATE_COUNT_MODE_RATE 0       // Pulses per second above which a channel switches to count mode. 0 = never.
+#endif
+#define COUNT_MODE_WINDOW 5000000       // Microseconds. Pulses are counted within windows of this length in count mode.
+#define COUNT_MODE_HYSTERESIS 2         // A channel leaves count mode, when the rate is below PRIVATE_COUNT_MODE_RATE / COUNT_MODE_HYSTERESIS.
 #define RETAINED true                   // Used in MQTT puplications. Can be changed during development and bugfixing.
 #define UNRETAINED false
-#define MAX_NO_OF_CHANNELS 8
+#define MAX_NO_OF_CHANNELS 24             // Limited by the number of bits in IRQ_PINs_stored and the number of free GPIO pins.
 #define MAX_NUMBER_OF_WRITES 65500      // Number of writes made to data file / SD Card, before new set of datafiles will be used (MAX 2^16)
+#define PULSE_RING_SIZE 32              // Number of pulse timestamps buffered per channel between ISR and the pulse task. Must be a power of two.
+#define PULSE_TASK_CORE 0               // Core running the pulse task. loop() runs on core 1 (ARDUINO_RUNNING_CORE).
+#define PULSE_TASK_PRIORITY 10          // Above loop() (1), below the WiFi and TCP/IP tasks.
+#define PULSE_TASK_STACK 8192           // Bytes. Writing to the SD card requires a large stack.
+#define PULSE_TASK_PERIOD 100           // Milliseconds between polls of the PCNT peripheral (CAPTURE_PCNT).
+#define PULSE_TASK_MAX_WAIT 3600000     // Maximum number of milliseconds the pulse task sleeps, when no deadline is due.
+#define PUBLISH_QUEUE_SIZE 32           // Number of publish events buffered between the pulse task and loop().
+#define STEP_QUEUE_SIZE 8               // Number of step events buffered between the pulse task and loop().
+#define STEP_MIN_PERCENT 20             // Smallest step in consumption detected (percent of the consumption before).
+#define STEP_THRESHOLD_FACTOR 6         // Higher values detect steps later, but are less sensitive to noise.
+#define DIAGNOSTICS_INTERVAL 60         // Minimum number of seconds between publishing channel diagnostics.
+#define LATENCY_BINS 24                 // Bins in the latency histograms. Bin k counts latencies of 2^k .. 2^(k+1) - 1 microseconds.
+#define LATENCY_INTERVAL 300            // Number of seconds between publishing latency histograms.
+#define LOAD_DURATION_BINS 32           // Bins in the load duration histograms. Half an octave per bin, see recordLoadDuration().
+#define SUBMETER_INTERVAL 900           // Seconds between sub meter reconciliations.
+#define SUBMETER_SAMPLES 4              // The rolling reconciliation window is SUBMETER_SAMPLES * SUBMETER_INTERVAL.
+#define SUBMETER_MIN_WH 100             // No alert, when the parent has used less than this (Wh) within the window.
+#define DEMAND_WINDOW 900               // Seconds. Demand is the average consumption within fixed windows of this length.
+#define BASELOAD_HOURS 24               // Hours the baseload is the lowest demand within.
+#define BASELOAD_NONE UINT32_MAX        // An hour without demand windows in baseloadSlot[].
+#define FORECAST_PROFILE_WEIGHT 0.25f   // Weight of the latest day in the learned hourly profile.
+#define TIME_SET_EPOCH 1600000000       // time() is assumed to be set by NTP, when above this (september 2020).
+#define STORM_WINDOW 1000000            // Microseconds. IRQ's are counted within windows of this length to detect interrupt storms.
+#define STORM_MARGIN 4                  // A storm is an IRQ rate STORM_MARGIN times above the rate possible at the maximum power.
+#define STORM_DEFAULT_LIMIT 250         // IRQ's per STORM_WINDOW, when the maximum power of an energy meter is not defined.
+#define STORM_BACKOFF_MIN 10            // Seconds a channel is masked after the first interrupt storm.
+#define STORM_BACKOFF_MAX 3600          // Maximum number of seconds a channel is masked. Also the time without storms to reset the backoff.
+#ifndef PRIVATE_PULSE_WIDTH_MS
+#define PRIVATE_PULSE_WIDTH_MS               // No pulse width validation, when no window is defined in privateConfig.h.
+uint16_t private_min_pulse_width_ms[PRIVATE_NO_OF_CHANNELS] = {};
+uint16_t private_max_pulse_width_ms[PRIVATE_NO_OF_CHANNELS] = {};
+#endif
+#ifndef PRIVATE_MAX_POWER_W
+#define PRIVATE_MAX_POWER_W                  // No plausibility hold-off, when no maximum power is defined in privateConfig.h.
+uint32_t private_max_power_W[PRIVATE_NO_OF_CHANNELS] = {};
+#endif
+#ifndef PRIVATE_RECONCILE_LOST_PULSES
+#define PRIVATE_RECONCILE_LOST_PULSES false  // Set to true in privateConfig.h to add lost pulses to the totals.
+#endif
+#ifndef PRIVATE_NO_OF_VIRTUAL
+#define PRIVATE_NO_OF_VIRTUAL 0              // No virtual meters, when none are defined in privateConfig.h.
+const char * private_virtualMeters[1] = {""};
+float private_virtualCoefficients[1][PRIVATE_NO_OF_CHANNELS] = {};
+#endif
+#define NO_OF_METERS (PRIVATE_NO_OF_CHANNELS + PRIVATE_NO_OF_VIRTUAL)   // Energy meters published to HA
+#ifndef PRIVATE_STEP_DETECTION
+#define PRIVATE_STEP_DETECTION false         // No step detection, when not defined in privateConfig.h.
+uint16_t private_step_min_W[PRIVATE_NO_OF_CHANNELS] = {};
+#endif
+#ifndef PRIVATE_SUBMETER_PARENT
+#define PRIVATE_SUBMETER_PARENT -1           // No sub meter reconciliation, when no parent is defined in privateConfig.h.
+bool private_subMeterChild[PRIVATE_NO_OF_CHANNELS] = {};
+#endif
+#ifndef PRIVATE_SUBMETER_ALERT_PERCENT
+#define PRIVATE_SUBMETER_ALERT_PERCENT 10
+#endif
+#ifndef PRIVATE_NO_OF_TARIFFS
+#define PRIVATE_NO_OF_TARIFFS 1              // One tariff all week, when no tariffs are defined in privateConfig.h.
+const char * private_tariffNames[PRIVATE_NO_OF_TARIFFS] = {"Normal"};
+uint8_t private_tariffTable[7][24] = {};
+#endif
+
+/* Pulse capture backends. The backend is selected by PRIVATE_CAPTURE_BACKEND in privateConfig.h
+ * CAPTURE_ISR   An interrupt is triggered by every pulse (Ext_INT_ISR). Default.
+ * CAPTURE_PCNT  Pulses are counted by the ESP32 pulse counter (PCNT) peripheral and collected by the pulse task
+ *               every PULSE_TASK_PERIOD. The hardware keeps counting while the pulse task is delayed, so no pulses are lost.
+ *               The ESP32 has PCNT_UNIT_MAX (8) PCNT units. Channels above that are captured by the ISR.
+ * CAPTURE_SAMPLER A hardware timer samples all channel GPIO's at PRIVATE_SAMPLE_RATE_HZ and each channel is debounced 
+ *               by a state machine. The CPU load is fixed no matter how noisy the lines are, and a broken cable
+ *               can not cause an interrupt storm.
+ */
+#define CAPTURE_ISR   0
+#define CAPTURE_PCNT  1
+#define CAPTURE_SAMPLER 2
+#ifndef PRIVATE_CAPTURE_BACKEND
+#define PRIVATE_CAPTURE_BACKEND CAPTURE_ISR
+#endif
+#ifndef PRIVATE_SAMPLE_RATE_HZ
+#define PRIVATE_SAMPLE_RATE_HZ 1000     // Samples per second per channel, when CAPTURE_SAMPLER is used.
+#endif
+#ifndef PRIVATE_DEBOUNCE_SAMPLES
+#define PRIVATE_DEBOUNCE_SAMPLES 5      // Number of samples required to change the debounced level, when CAPTURE_SAMPLER is used.
+#endif
+#define SAMPLE_TIMER 0                  // Hardware timer used by CAPTURE_SAMPLER
+#define PCNT_HIGH_LIMIT 32767           // The PCNT counter is reset to 0 when this value is reached.
+#define PCNT_FILTER_VALUE 1023          // PCNT glitch filter in APB clock cycles (80 MHz). 1023 (12.8 µs) is the maximum.
 
 /* Configurable MQTT difinitions
  * These definitions can be changed to suitable nanes.
@@ -175,10 +347,54 @@ const String  MQTT_ONLINE                   = "/online";
 const String  MQTT_SENSOR_ENERG_ENTITYNAME  = "Subtotal";  // name dislayed in HA device. No special chars, no spaces
 const String  MQTT_SENSOR_POWER_ENTITYNAME  = "Forbrug";   // name dislayed in HA device. No special chars, no spaces
 const String  MQTT_NUMBER_ENERG_ENTITYNAME  = "Total";     // name dislayed in HA device. No special chars, no spaces
+const String  MQTT_DEMAND_WINDOW_ENTITYNAME = "DemandWindow";  // Energy in the current demand window
+const String  MQTT_DEMAND_ENTITYNAME        = "Demand";        // Demand of the previous window
+const String  MQTT_DEMAND_DAY_ENTITYNAME    = "DemandToday";   // Maximum demand today
+const String  MQTT_DEMAND_MONTH_ENTITYNAME  = "DemandMonth";   // Maximum demand this month
+const String  MQTT_BASELOAD_ENTITYNAME      = "Baseload";      // Lowest demand within the last 24 hours
+const String  MQTT_FORECAST_DAY_ENTITYNAME  = "ForecastToday"; // Energy expected to be used today
+const String  MQTT_FORECAST_MONTH_ENTITYNAME = "ForecastMonth"; // Energy expected to be used this month
+const String  MQTT_POWER_ESTIMATED          = "Estimated"; // true if the consumption is estimated, because pulses have stopped arriving.
 const String  MQTT_PULSTIME_CORRECTION      = "pulscorr";
+const String  MQTT_POWER_WINDOW             = "window";
 const String  MQTT_SKTECH_VERSION           = "/sketch_version";
 const String  MQTT_SUFFIX_STATE             = "/state";
+const String  MQTT_SUFFIX_DEMAND            = "/demand";
 const String  MQTT_SUFFIX_CONSUMPTION       = "/watt_consumption";
+const String  MQTT_SUFFIX_DIAGNOSTICS       = "/diagnostics";
+const String  MQTT_DIAG_REJECTED            = "rejected";
+const String  MQTT_DIAG_OVERFLOW            = "overflow";
+const String  MQTT_DIAG_IMPLAUSIBLE         = "implausible";
+const String  MQTT_DIAG_STORMS              = "storms";
+const String  MQTT_DIAG_FAULT               = "fault";
+const String  MQTT_DIAG_RAW                 = "raw";
+const String  MQTT_DIAG_PROCESSED           = "processed";
+const String  MQTT_DIAG_LOST                = "lost";
+const String  MQTT_DIAG_RECONCILED          = "reconciled";
+const String  MQTT_DIAG_DROPPED             = "dropped";
+const String  MQTT_SUFFIX_LATENCY           = "/latency";
+const String  MQTT_LATENCY_PUBLISH          = "publish";
+const String  MQTT_LATENCY_SD               = "sd";
+const String  MQTT_SUFFIX_LOAD_DURATION     = "/load_duration";
+const String  MQTT_LOAD_DURATION_SECONDS    = "seconds";
+const String  MQTT_SUFFIX_MINUTE            = "/minute";
+const String  MQTT_SUFFIX_SUBMETERS         = "/submeters";
+const String  MQTT_SUFFIX_STEP              = "/step";
+const String  MQTT_STEP_STEP                = "step";
+const String  MQTT_STEP_FROM                = "from";
+const String  MQTT_STEP_TO                  = "to";
+const String  MQTT_STEP_TIME                = "time";
+const String  MQTT_SUBMETER_PARENT          = "parent";
+const String  MQTT_SUBMETER_CHILDREN        = "children";
+const String  MQTT_SUBMETER_UNEXPLAINED     = "unexplained";
+const String  MQTT_SUBMETER_PERCENT         = "percent";
+const String  MQTT_SUBMETER_ALERT           = "alert";
+const String  MQTT_MINUTE_TIME              = "time";
+const String  MQTT_MINUTE_ENERGY            = "Wh";
+const String  MQTT_MINUTE_MIN               = "min";
+const String  MQTT_MINUTE_AVERAGE           = "avg";
+const String  MQTT_MINUTE_MAX               = "max";
+const String  MQTT_MINUTE_PULSES            = "pulses";
 // MQTT Subscription topics
 const String  MQTT_SUFFIX_TOTAL_TRESHOLD    = "/threshold";
 const String  MQTT_SUFFIX_SUBTOTAL_RESET    = "/subtotal_reset";
@@ -234,15 +450,21 @@ int errorIndex = 0;
 int previousErrorIndex = 0;
 
 uint16_t blip = BLIP;
-uint8_t GlobalIRQ_PIN_index = 0;
 uint16_t numberOfWrites = 0;
 uint8_t GoogleSheetMessageIndex = 1;  // Setting message in GS to PowerUp
 
 // Define array of GPIO pin numbers used for IRQ.
-const uint8_t channelPin[MAX_NO_OF_CHANNELS] = {private_Metr1_GPIO,private_Metr2_GPIO,private_Metr3_GPIO,private_Metr4_GPIO,
-                                                private_Metr5_GPIO,private_Metr6_GPIO,private_Metr7_GPIO,private_Metr8_GPIO};  
-
-bool configurationPublished[PRIVATE_NO_OF_CHANNELS];  // a flag for publishing the configuration to HA if required.
+// A privateConfig.h from before version 5.0.0 defines a GPIO pin for each of the eight channels instead of PRIVATE_CHANNEL_PINS.
+#ifndef PRIVATE_CHANNEL_PINS
+#define PRIVATE_CHANNEL_PINS {private_Metr1_GPIO,private_Metr2_GPIO,private_Metr3_GPIO,private_Metr4_GPIO,\
+                              private_Metr5_GPIO,private_Metr6_GPIO,private_Metr7_GPIO,private_Metr8_GPIO}
+#endif
+static_assert(PRIVATE_NO_OF_CHANNELS <= MAX_NO_OF_CHANNELS, "PRIVATE_NO_OF_CHANNELS exceeds MAX_NO_OF_CHANNELS");
+static_assert(PRIVATE_NO_OF_VIRTUAL <= 32, "PRIVATE_NO_OF_VIRTUAL exceeds the number of bits in virtualPending");
+DRAM_ATTR const uint8_t channelPin[MAX_NO_OF_CHANNELS] = PRIVATE_CHANNEL_PINS;   // Read by the ISR, hence placed in DRAM
+
+bool configurationPublished[NO_OF_METERS];            // a flag for publishing the configuration to HA if required.
+bool configurationsPending = true;                    // True if configurationPublished[] is false for any channel.
 bool esp32Connected = false;                          // Is true, when connected to WiFi and MQTT Broker
 bool LED_ToggledState = false; 
 bool LED_Invertred = false;
@@ -258,21 +480,112 @@ struct config_t
     unsigned long pulseTimeCorrection;      // Used to calibrate the calculated consumption.
     uint16_t dataFileSetNumber;               // In which data file set ("directory") the data files will be located.
     uint16_t  pulse_per_kWh[PRIVATE_NO_OF_CHANNELS];       // Number of pulses as defined for each energy meter
+    uint8_t powerWindow[PRIVATE_NO_OF_CHANNELS];           // Number of pulse intervals the consumption is averaged over. Added in version 6.
   } interfaceConfig;
 
 // Define stgructure for meta data
 struct meta_t
   {
-    unsigned long pulseTimeStamp;   // Stores timestamp, Usec to calculate millis bewteen pulses ==> Calsulate consupmtion.
-    unsigned long pulseLength;      // Sorees time between pulses. Used to publish 0 to powerconsumption, when pulses stops arriving == poser comsumptino reduced
+    int64_t pulseTimeStamp;         // Stores timestamp (microseconds), Used to calculate time bewteen pulses ==> Calsulate consupmtion.
+    long decayWatt;                 // Consumption published latest by the pulse task (W). The estimated consumption will not exceed it.
+    int64_t decayAt;                // Timestamp (microseconds) for publishing the next estimated consumption. 0 when not scheduled.
   } metaData[PRIVATE_NO_OF_CHANNELS];
 
+// Constants for the consumption calculation. Calculated by setConsumptionEngines() from interfaceConfig.
+consumptionEngine_t consumptionEngine[PRIVATE_NO_OF_CHANNELS];
+// The latest pulse intervals for each channel. Only used by the pulse task, and by setConsumptionEngines() with meterDataMutex taken.
+powerWindow_t powerWindow[PRIVATE_NO_OF_CHANNELS];
+
+long lastPublishedWatt[PRIVATE_NO_OF_CHANNELS];               // Consumption published latest. Used for the deadband.
+unsigned long lastPublishedAt[PRIVATE_NO_OF_CHANNELS];        // Timestamp (sec()) for when the consumption was published latest.
+
+/* Count mode.
+ * When the time between pulses becomes shorter than 1 / PRIVATE_COUNT_MODE_RATE seconds, the channel switches to count mode.
+ * Pulses are then counted within windows of COUNT_MODE_WINDOW, and meterData[] is written to SD and published once per window.
+ * The consumption is the energy of the pulses in the window divided by the time from the latest pulse before the window 
+ * to the latest pulse in the window. Thereby only whole pulse intervals are used.
+ * Only used by the pulse task.
+ */
+bool countMode[PRIVATE_NO_OF_CHANNELS];
+int64_t countWindowStart[PRIVATE_NO_OF_CHANNELS];       // Timestamp for the beginning of the current window.
+int64_t countWindowReference[PRIVATE_NO_OF_CHANNELS];   // Timestamp of the latest pulse before the current window.
+uint32_t countWindowPulses[PRIVATE_NO_OF_CHANNELS];     // Number of pulses in the current window.
+
+/*
+ * Virtual meters. The consumption of a virtual meter is the linear combination (private_virtualCoefficients) of the 
+ * consumption latest published for each energy meter. Totals and subtotals are calculated from meterData[] when published,
+ * so virtual meters are stored with the energy meters. Only used by loop().
+ */
+long channelWatt[PRIVATE_NO_OF_CHANNELS];               // Consumption latest queued for publishing by the pulse task.
+uint32_t channelEstimated = 0;                          // One bit per channel. Set if channelWatt[] is estimated.
+uint32_t virtualChannels[PRIVATE_NO_OF_VIRTUAL];        // One bit per channel contributing to the virtual meter.
+uint32_t virtualPending = 0;                            // One bit per virtual meter to be published.
+
+/*
+ * Baseload (standby power). The lowest demand (W) of the demand windows ended within each of the latest BASELOAD_HOURS
+ * hours. The slot of an hour is cleared, when it is reused 24 hours later. The first window after the demand registers
+ * have been started is left out, as it only holds the pulses since then. Guarded by meterDataMutex.
+ */
+uint32_t baseloadSlot[PRIVATE_NO_OF_CHANNELS][BASELOAD_HOURS];
+uint32_t baseloadHour[PRIVATE_NO_OF_CHANNELS];          // The hour (time() / 3600) latest updated.
+uint32_t baseloadFirstWindow[PRIVATE_NO_OF_CHANNELS];   // Demand window started with no previous window.
+
+/*
+ * Forecast. The learned hourly profile is the number of pulses within each hour of the day (local time), as an exponential
+ * moving average over the latest days. Only whole hours are learned, so the hour the device was started in is left out.
+ * Guarded by meterDataMutex.
+ */
+float forecastProfile[PRIVATE_NO_OF_CHANNELS][24];
+uint32_t forecastLearned[PRIVATE_NO_OF_CHANNELS];       // One bit per hour of the day learned in forecastProfile[].
+uint32_t forecastHour[PRIVATE_NO_OF_CHANNELS];          // The hour (time() / 3600) counted in forecastHourPulses[].
+uint32_t forecastFirstHour[PRIVATE_NO_OF_CHANNELS];     // The hour counted from the middle, when the device was started.
+uint32_t forecastHourPulses[PRIVATE_NO_OF_CHANNELS];    // Number of pulses within forecastHour[].
+
+/*
+ * Sub meter reconciliation. Snapshots of the energy (milliwatt hours) of the parent and the sum of the sub meters,
+ * taken from meterData[].pulseTotal every SUBMETER_INTERVAL. The oldest of the SUBMETER_SAMPLES + 1 snapshots is the 
+ * beginning of the rolling window. Only used by loop().
+ */
+int64_t subMeterParent[SUBMETER_SAMPLES + 1];
+int64_t subMeterChildren[SUBMETER_SAMPLES + 1];
+uint8_t subMeterNext = 0;                               // Index for the next snapshot
+uint8_t subMeterCount = 0;                              // Number of snapshots. 0 .. SUBMETER_SAMPLES + 1
+bool subMeterAlert = false;                             // True while the unexplained difference exceeds the alert threshold.
+unsigned long subMeterCheckedAt = 0;                    // Timestamp (sec()) for the latest reconciliation.
+
+/*
+ * Next time the pulse task must handle a channel without pulses: The end of the count window in count mode, otherwise 
+ * the next estimated consumption (metaData[].decayAt). Channels without a deadline are not in the queue.
+ * Only used by the pulse task.
+ */
+deadlineQueue_t channelDeadlines;
+
 // Define structure for energy meter counters
 struct data_t
   {
     unsigned long pulseTotal;                // For counting total number of pulses on each Channel
     unsigned long pulseSubTotal;             // For counting number of pulses within a period 
+    // Demand registers. Added in version 5.0.0. Data files from before only hold the counters above.
+    uint32_t demandWindow;                   // Current demand window (time() / DEMAND_WINDOW). 0 until NTP time is set.
+    uint32_t demandPulses;                   // Number of pulses in the current demand window
+    uint32_t demandPrevious;                 // Demand (W) of the previous window
+    uint32_t demandMaxDay;                   // Maximum demand (W) of the windows ended today
+    uint32_t demandMaxMonth;                 // Maximum demand (W) of the windows ended this month
+    uint32_t demandDay;                      // Day of demandMaxDay and dayPulses (tm_year * 366 + tm_yday)
+    uint32_t demandMonth;                    // Month of demandMaxMonth and monthPulses (tm_year * 12 + tm_mon)
+    unsigned long tariffPulses[PRIVATE_NO_OF_TARIFFS];  // Total number of pulses within each tariff
+    uint32_t dayPulses;                      // Number of pulses today (local time)
+    uint32_t monthPulses;                    // Number of pulses this month (local time)
   } meterData[PRIVATE_NO_OF_CHANNELS];
+#define DATA_LEGACY_SIZE offsetof(data_t, demandWindow)  // Size of data files written before the demand registers
+
+/*
+ * The tariff for the hour latest looked up by getTariff(). Pulses within the same hour do not call localtime_r().
+ * Guarded by meterDataMutex.
+ */
+time_t tariffHourStart = 0;
+time_t tariffHourEnd = 0;
+uint8_t tariffCurrent = 0;
 
 /* Wariables to handle connect postpones and length of LED blinks*/
 unsigned long WiFiConnectAttempt = 0;   // Timestamp when an attempt to connect to WiFi were done
@@ -284,11 +597,131 @@ unsigned long MQTTConnectPostpone = 0;  // Millisecunds between each attempt to
 unsigned long timeLastCheckedAt;        // Timestamp for when epoch time was checked.
 unsigned long secondsToNextTimeCheck;    // Number of seconds to next epoch time check.
 
-unsigned long LED_toggledAt = 0;        // Timestamp when an IRQ tuggels the LED
+int64_t LED_toggledAt = 0;              // Timestamp (microseconds) when an IRQ tuggels the LED
+
+/* Pulse ring buffers.
+ * Each channel has a Single Producer Single Consumer (SPSC) ring buffer. The ISR is the only writer of pulseRingHead[] and
+ * the pulse task is the only writer of pulseRingTail[], so no locking is required for the ring buffers themselves.
+ * Head and tail are free running counters. The number of buffered timestamps is (head - tail).
+ */
+volatile int64_t pulseRing[PRIVATE_NO_OF_CHANNELS][PULSE_RING_SIZE];  // Used by the ISR to store exactly when an interrupt occoured (microseconds). 
+                                                                      // Used to calculate consuption.
+volatile uint16_t pulseRingHead[PRIVATE_NO_OF_CHANNELS];       // Next free slot. Only written by the ISR.
+volatile uint16_t pulseRingTail[PRIVATE_NO_OF_CHANNELS];       // Next slot to be processed. Only written by the pulse task.
+volatile unsigned long pulseRingOverflow[PRIVATE_NO_OF_CHANNELS];  // Number of pulses lost because the ring buffer was full.
+volatile uint32_t IRQ_PINs_stored = 0;            // Used by the ISR to register which energy meter caused an interrupt. One bit per channel.
+portMUX_TYPE pulseRingMux = portMUX_INITIALIZER_UNLOCKED;     // Protects IRQ_PINs_stored and the lost pulse counters with head and tail.
+
+/* Pulse width validation.
+ * The ISR is triggered by both edges. A pulse begins at the rising edge and is accepted at the falling edge,
+ * if the pulse width is within minPulseWidth .. maxPulseWidth. A maxPulseWidth of 0 disables the validation.
+ */
+uint32_t minPulseWidth[PRIVATE_NO_OF_CHANNELS];               // Microseconds
+uint32_t maxPulseWidth[PRIVATE_NO_OF_CHANNELS];               // Microseconds
+volatile int64_t pulseRiseTime[PRIVATE_NO_OF_CHANNELS];       // Timestamp of the rising edge. 0 when no pulse is in progress.
+volatile unsigned long rejectedPulses[PRIVATE_NO_OF_CHANNELS]; // Number of pulses rejected by the pulse width validation.
+
+/* Plausibility hold-off.
+ * A pulse arriving less than pulseHoldOff[] after the previous accepted pulse would mean a power above the maximum
+ * power of the energy meter (private_max_power_W[]). Such pulses are dropped and counted in implausiblePulses[].
+ * pulseHoldOff[] = 60*60*1000000*1000 / (pulse_per_kWh * max power). A pulseHoldOff[] of 0 disables the check.
+ */
+uint32_t pulseHoldOff[PRIVATE_NO_OF_CHANNELS];                // Microseconds
+volatile int64_t lastPulseTime[PRIVATE_NO_OF_CHANNELS];       // Timestamp of the latest accepted pulse.
+volatile unsigned long implausiblePulses[PRIVATE_NO_OF_CHANNELS]; // Number of pulses dropped by the plausibility hold-off.
+
+/* Interrupt storm protection.
+ * The ISR counts IRQ's for each channel within windows of STORM_WINDOW. If more than stormLimit[] IRQ's arrive
+ * within a window, the bit for the channel is set in stormMaskedPins and the ISR ignores further IRQ's for the channel.
+ * handleInterruptStorms() detaches the interrupt and re-attaches it after stormBackoff[] seconds.
+ */
+uint32_t stormLimit[PRIVATE_NO_OF_CHANNELS];                  // Maximum number of IRQ's within a STORM_WINDOW.
+volatile int64_t stormWindowStart[PRIVATE_NO_OF_CHANNELS];    // Timestamp for the beginning of the current window.
+volatile uint32_t stormIRQs[PRIVATE_NO_OF_CHANNELS];          // Number of IRQ's in the current window.
+volatile uint32_t stormMaskedPins = 0;                        // Channels masked by the ISR because of an interrupt storm. One bit per channel.
+uint32_t stormDetachedPins = 0;                               // Channels, which interrupts has been detached.
+unsigned long stormMaskedAt[PRIVATE_NO_OF_CHANNELS];          // Timestamp (sec()) when the channel was masked.
+unsigned long stormAttachedAt[PRIVATE_NO_OF_CHANNELS];        // Timestamp (sec()) when the channel was re-attached.
+unsigned long stormBackoff[PRIVATE_NO_OF_CHANNELS];           // Seconds the channel will be masked.
+unsigned long stormCount[PRIVATE_NO_OF_CHANNELS];             // Number of interrupt storms detected.
+
+/* Lost pulse accounting.
+ * rawPulses[] is incremented by store_IRQ_PIN() for every pulse accepted by the capture layer, and processedPulses[] 
+ * by the pulse task for every pulse counted in meterData[]. Pulses still waiting in the ring buffer are neither processed nor lost.
+ * Lost pulses = rawPulses[] - processedPulses[] - pulses in the ring buffer.
+ * rawPulses[] is incremented together with pulseRingHead[], and processedPulses[] together with pulseRingTail[], within
+ * pulseRingMux. Otherwise a pulse between the ring buffer and the counter would be seen as lost by getLostPulses().
+ */
+volatile unsigned long rawPulses[PRIVATE_NO_OF_CHANNELS];     // Only written by the ISR (or pollPulseCounters()).
+unsigned long processedPulses[PRIVATE_NO_OF_CHANNELS];        // Only written by the pulse task.
+unsigned long reconciledPulses[PRIVATE_NO_OF_CHANNELS];       // Lost pulses added to meterData[] by PRIVATE_RECONCILE_LOST_PULSES.
+
+unsigned long diagnosticsCheckedAt = 0;                       // Timestamp (sec()) for when diagnostics were checked for changes.
+unsigned long diagnosticsPublished[PRIVATE_NO_OF_CHANNELS];   // Sum of diagnostics counters at last publish.
+
+pulseSampler_t pulseSampler[PRIVATE_NO_OF_CHANNELS];         // Debounce state machines used by CAPTURE_SAMPLER.
+uint32_t sampleCount = 0;                                     // Number of samples taken by CAPTURE_SAMPLER.
+hw_timer_t * sampleTimer = NULL;
+
+int16_t pcntCounted[PRIVATE_NO_OF_CHANNELS];          // PCNT counter value already transferred to the ring buffer.
+int64_t pcntPolledAt[PRIVATE_NO_OF_CHANNELS];         // Timestamp given to the latest pulse transferred from the PCNT counter.
+
+/* Pulse task.
+ * Pulses are processed, counted in meterData[] and written to the SD card by pulseTask(), which is pinned to PULSE_TASK_CORE.
+ * loop() handles WiFi, MQTT, OTA and Google Sheets on the other core, and publishes the values queued in publishQueue by the
+ * pulse task. A blocking network call will therefore never delay the pulse processing.
+ * meterDataMutex protects meterData[], interfaceConfig and the SD card, as they are accessed by both tasks.
+ */
+struct publishEvent_t
+  {
+    uint8_t IRQ_PIN_index;
+    long watt_consumption;
+    bool pulse;                     // True if the event is caused by pulses. Used to blink the LED. 
+                                    // False for an estimated consumption from the pulse time check.
+    int64_t pulseStoredAt;          // pulseStoredAt[] for the pulses. 0 if not caused by pulses.
+  };
+TaskHandle_t pulseTaskHandle = NULL;
+QueueHandle_t publishQueue = NULL;
+SemaphoreHandle_t meterDataMutex = NULL;
+unsigned long publishDropped[PRIVATE_NO_OF_CHANNELS];   // Number of publish and step events dropped because the queue was full.
+
+/* Step detection.
+ * Steps in consumption detected by the pulse task are passed to loop() in stepQueue. stepDetector[] is only used by the pulse task.
+ */
+struct stepEvent_t
+  {
+    uint8_t IRQ_PIN_index;
+    long wattBefore;                // Consumption before the step
+    long wattAfter;                 // Consumption after the step
+    time_t time;                    // Time of the pulse, which revealed the step (seconds since epoch)
+  };
+QueueHandle_t stepQueue = NULL;
+stepDetector_t stepDetector[PRIVATE_NO_OF_CHANNELS];
+
+/* Latency instrumentation.
+ * pulseStoredAt[] is the time store_IRQ_PIN() stored the latest pulse for the channel. The time from then until the consumption
+ * is passed to publishSensorJson(), and until writeMeterData() has completed, is counted in log2 histograms (microseconds).
+ * The histograms count since boot, and are published every LATENCY_INTERVAL.
+ */
+volatile int64_t pulseStoredAt[PRIVATE_NO_OF_CHANNELS];                 // Only written by the ISR (or pollPulseCounters()).
+uint32_t publishLatency[PRIVATE_NO_OF_CHANNELS][LATENCY_BINS];          // Only written by loop().
+uint32_t sdLatency[PRIVATE_NO_OF_CHANNELS][LATENCY_BINS];               // Only written by the pulse task.
+unsigned long latencyPublishedAt = 0;                                   // Timestamp (sec()) for when latency histograms were published.
+
+/* Load duration histograms.
+ * The time (microseconds) with a consumption within each bin, since the subtotals were reset. loadDurationAt[] is the 
+ * timestamp up till which the time has been counted. Guarded by meterDataMutex.
+ */
+int64_t loadDuration[PRIVATE_NO_OF_CHANNELS][LOAD_DURATION_BINS];
+int64_t loadDurationAt[PRIVATE_NO_OF_CHANNELS];
 
-volatile unsigned long millsTimeStamp[PRIVATE_NO_OF_CHANNELS];  // Used by the ISR to store exactly when an interrupt occoured. 
-                                                                // Used to calculate consuption.
-volatile uint8_t  IRQ_PINs_stored = 0b00000000;   // Used by the ISR to register which energy meter caused an interrupt.
+/*
+ * Per minute aggregates. Updated by the pulse task for every pulse and consumption calculated, published and reset 
+ * by loop() when the minute (local time) changes. Guarded by meterDataMutex.
+ */
+minuteAggregate_t minuteAggregate[PRIVATE_NO_OF_CHANNELS];
+time_t aggregateMinute = 0;                                             // Current minute (time() / 60).
+int64_t aggregateMinuteStart = 0;                                       // Timestamp (microseconds) for the beginning of the current minute.
 /*
  * ##################################################################################################
  * ##################################################################################################
@@ -302,6 +735,9 @@ void writeConfigData();
 void writeMeterDataFile( uint8_t);
 void writeMeterData(uint8_t);
 void setConfigurationDefaults();
+void setPulseHoldOff();
+void setConsumptionEngines();
+void handleInterruptStorms();
 void initializeGlobals();
 void publish_sketch_version();
 void publishStatusMessage(String);
@@ -309,19 +745,47 @@ byte getIRQ_PIN_reference(char*);
 bool updateGoogleSheets( uint8_t);
 unsigned long getsecondsToNextTimeCheck();
 unsigned long sec();
-void publishMqttEnergyConfigJson( String, String, String, String, u_int8_t);
+void publishMqttEnergyConfigJson( String, String, String, String, u_int8_t, String);
+void publishDemandJson( uint8_t);
+void updateVirtualMeters( uint8_t, long, bool);
+void reconcileSubMeters();
+void publishSubMetersJson( int64_t, int64_t);
+void publishVirtualJson( uint8_t);
+bool updateDemand( uint8_t, time_t);
+void updateBaseload( uint8_t, uint32_t, uint32_t);
+long getBaseload( uint8_t);
+void updateForecast( uint8_t, time_t);
+bool getForecast( uint8_t, time_t, float*, float*);
+uint8_t getTariff( time_t);
+void checkDemandPeriod( uint8_t, time_t);
 void publishMqttConfigurations( uint8_t);
-void publishSensorJson( long, uint8_t);
+void publishSensorJson( long, uint8_t, bool);
+void publishDiagnosticsJson( uint8_t);
+void publishLatencyJson( uint8_t);
+void publishMinuteJson( uint8_t, const minuteAggregate_t*, int64_t);
+void recordLatency( uint32_t*, int64_t);
+void recordLoadDuration( uint8_t, long, int64_t);
+void publishLoadDurations();
+void publishLoadDurationJson( uint8_t, const int64_t*);
+unsigned long getLostPulses( uint8_t);
 void mqttCallback(char*, byte*, unsigned int);
-void IRAM_ATTR store_IRQ_PIN(u_int8_t);
-void IRAM_ATTR Ext_INT1_ISR();
-void IRAM_ATTR Ext_INT2_ISR();
-void IRAM_ATTR Ext_INT3_ISR();
-void IRAM_ATTR Ext_INT4_ISR();
-void IRAM_ATTR Ext_INT5_ISR();
-void IRAM_ATTR Ext_INT6_ISR();
-void IRAM_ATTR Ext_INT7_ISR();
-void IRAM_ATTR Ext_INT8_ISR();
+void initPulseCounters();
+void pollPulseCounters();
+void initPulseSampler();
+void IRAM_ATTR onSampleTimer();
+void pulseTask(void*);
+void processPulses();
+void checkDeadlines();
+void checkPulseTime( uint8_t, int64_t);
+void scheduleDecay( uint8_t);
+void setChannelDeadline( uint8_t);
+void checkCountWindow( uint8_t, int64_t);
+void queuePublishEvent( uint8_t, long, bool, int64_t);
+void detectStep( uint8_t, int64_t, time_t);
+void publishStepJson( const stepEvent_t*);
+void IRAM_ATTR store_IRQ_PIN(u_int8_t, int64_t);
+void IRAM_ATTR notifyPulseTask();
+void IRAM_ATTR Ext_INT_ISR(void*);
 /*
  * ###################################################################################################
  * ###################################################################################################
@@ -347,26 +811,31 @@ void setup() {
     pinMode(channelPin[ii], INPUT);
   }
 
-  // arm interrupt. Create a functioncall for each interrupt pin
-  if ( PRIVATE_NO_OF_CHANNELS >= 1)
-    attachInterrupt(private_Metr1_GPIO, Ext_INT1_ISR, RISING);
-  if ( PRIVATE_NO_OF_CHANNELS >= 2)
-    attachInterrupt(private_Metr2_GPIO, Ext_INT2_ISR, RISING);
-  if ( PRIVATE_NO_OF_CHANNELS >= 3)
-    attachInterrupt(private_Metr3_GPIO, Ext_INT3_ISR, RISING);
-  if ( PRIVATE_NO_OF_CHANNELS >= 4)
-    attachInterrupt(private_Metr4_GPIO, Ext_INT4_ISR, RISING);
-  if ( PRIVATE_NO_OF_CHANNELS >= 5)
-    attachInterrupt(private_Metr5_GPIO, Ext_INT5_ISR, RISING);
-  if ( PRIVATE_NO_OF_CHANNELS >= 6)
-    attachInterrupt(private_Metr6_GPIO, Ext_INT6_ISR, RISING);
-  if ( PRIVATE_NO_OF_CHANNELS >= 7)
-    attachInterrupt(private_Metr7_GPIO, Ext_INT7_ISR, RISING);
-  if ( PRIVATE_NO_OF_CHANNELS >= 8)
-    attachInterrupt(private_Metr8_GPIO, Ext_INT8_ISR, RISING);
-
   initializeGlobals();
 
+  meterDataMutex = xSemaphoreCreateMutex();
+  publishQueue = xQueueCreate( PUBLISH_QUEUE_SIZE, sizeof(publishEvent_t));
+  stepQueue = xQueueCreate( STEP_QUEUE_SIZE, sizeof(stepEvent_t));
+
+#if PRIVATE_CAPTURE_BACKEND == CAPTURE_PCNT
+  initPulseCounters();
+#elif PRIVATE_CAPTURE_BACKEND == CAPTURE_SAMPLER
+  initPulseSampler();
+#endif
+
+  // arm interrupt. The common ISR is attached to each channel, which is not counted by a PCNT unit.
+  // The channel number is passed to the ISR as argument. Both edges are needed to validate the pulse width.
+  for ( uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
+  {
+#if PRIVATE_CAPTURE_BACKEND == CAPTURE_PCNT
+    if ( ii < PCNT_UNIT_MAX)
+      continue;
+#elif PRIVATE_CAPTURE_BACKEND == CAPTURE_SAMPLER
+    break;
+#endif
+    attachInterruptArg(channelPin[ii], Ext_INT_ISR, (void *)(uintptr_t)ii, CHANGE);
+  }
+
   mqttClient.setServer(PRIVATE_MQTT_SERVER.c_str(), PRIVATE_MQTT_PORT);
   mqttClient.setCallback(mqttCallback);
 
@@ -390,12 +859,26 @@ void setup() {
     }
   }
 
+  // A configuration from version 5 is the first part of the current configuration. Keep it and add the new fields.
+  if ( interfaceConfig.structureVersion == (5 * 100) + PRIVATE_NO_OF_CHANNELS)
+  {
+    interfaceConfig.structureVersion = (CONFIGURATON_VERSION * 100) + PRIVATE_NO_OF_CHANNELS;
+    for (uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
+      interfaceConfig.powerWindow[ii] = PRIVATE_POWER_WINDOW;
+    if ( !SD_Failed)
+      writeConfigData();
+  }
+
   // Check if new configuration and datafiles are required
   if ( interfaceConfig.structureVersion != (CONFIGURATON_VERSION * 100) + PRIVATE_NO_OF_CHANNELS)
   {
     setConfigurationDefaults();
   }
 
+  // The plausibility hold-off and the consumption calculation depend on the configuration.
+  setPulseHoldOff();
+  setConsumptionEngines();
+
   // Check if new datafileser (directory) is required
   String dirname = String (DATAFILESET_POSTFIX + String(interfaceConfig.dataFileSetNumber));
   if ( !SD.exists(dirname))
@@ -424,15 +907,22 @@ void setup() {
     String filename = String (DATAFILESET_POSTFIX + String(interfaceConfig.dataFileSetNumber) +\
                               FILENAME_POSTFIX + String(ii) + FILENAME_SUFFIX);
     File structFile = SD.open(filename, FILE_READ);
-    if ( structFile && structFile.read((uint8_t *)&meterData[ii], sizeof(meterData[ii])/sizeof(uint8_t)) !=\
-          sizeof(meterData[ii])/sizeof(uint8_t)) 
+    if ( structFile)
     {
-      meterData[ii].pulseTotal = 0;
-      meterData[ii].pulseSubTotal = 0;
+      /* A data file written by a previous version is shorter, as fields have been added to data_t since. 
+       * Keep the fields read, and clear the fields added. Files shorter than the counters are not used.
+       */
+      int bytesRead = structFile.read((uint8_t *)&meterData[ii], sizeof(meterData[ii])/sizeof(uint8_t));
+      if ( bytesRead < (int)DATA_LEGACY_SIZE)
+        bytesRead = 0;
+      memset( (uint8_t *)&meterData[ii] + bytesRead, 0, sizeof(meterData[ii]) - bytesRead);
     }
     structFile.close();
   }
 
+  // Start the pulse task. Pulses registered since the interrupts were armed are waiting in the ring buffers.
+  xTaskCreatePinnedToCore( pulseTask, "pulseTask", PULSE_TASK_STACK, NULL, PULSE_TASK_PRIORITY, &pulseTaskHandle, PULSE_TASK_CORE);
+
   digitalWrite(LED_BUILTIN, HIGH);           // Turn OFF LED before entering loop
 }
 
@@ -448,9 +938,8 @@ void setup() {
 void loop() 
 {
   // >>>>>>>>>>>>>>>>>>>>>>>>   Connect to WiFi if not connected    <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
-  // Ingore WiFi connect if IRQ's are present.
-  if ( IRQ_PINs_stored == 0 and \
-       WiFi.status() != WL_CONNECTED and sec() > WiFiConnectAttempt + WiFiConnectPostpone)
+  // Pulses are handled by the pulse task meanwhile.
+  if ( WiFi.status() != WL_CONNECTED and sec() > WiFiConnectAttempt + WiFiConnectPostpone)
   {
 
     /* Turn Build in LED (LED) ON, when not connected to WiFi.
@@ -554,8 +1043,7 @@ void loop()
   // >>>>>>>>>>>>>>>>>>>>>>>>   E N D  Connect to WiFi if not connected    <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
 
   // >>>>>>>>>>>>>>>>>>>>   Connect to MQTT broker IF  Connected to WiFi   <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
-  // Ignore connect to MQTT if IRQ's are present-
-  if ( IRQ_PINs_stored == 0 and WiFi.status() == WL_CONNECTED)
+  if ( WiFi.status() == WL_CONNECTED)
   {
     if (LED_Invertred == true)
     {
@@ -618,145 +1106,84 @@ void loop()
   }
   //  <<< END Process incomming messages
 
-  // >>>>>>>>>>>>>>>>>>>>   Publis meterData (If any)   <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
-  if ( IRQ_PINs_stored > 0)
-  {                                  // If IRQ has occoured IRQ_PINs_store will be > 0.
-    uint8_t pinMask = 0b00000001;    // Set pinMask to start check if the Least significant Bit (LSB) is set ( = 1)
-
+  // >>>>>>>>>>>>>>>>>>>>   Publish values queued by the pulse task (If any)   <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+  publishEvent_t publishEvent;
+  while ( xQueueReceive( publishQueue, &publishEvent, 0) == pdTRUE)
+  {
     // >>>>>>>>>>>>>>>>  Tuggle LED pin if not toggled allready  <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
-    if ( !LED_ToggledState)
+    if ( publishEvent.pulse && !LED_ToggledState)
     {
-       digitalWrite(LED_BUILTIN, !digitalRead (LED_BUILTIN));
+      digitalWrite(LED_BUILTIN, !digitalRead (LED_BUILTIN));
       LED_ToggledState = true;
-      LED_toggledAt = millis();
+      LED_toggledAt = esp_timer_get_time();
     }
 
-    // Iterate through all bits in the byte IRQ_PINs_stored.
-    for( uint8_t IRQ_PIN_index = 0; IRQ_PIN_index < PRIVATE_NO_OF_CHANNELS; IRQ_PIN_index++)
-    {
-      // Publish configuration to MQTT broker if not allready done.
-      if( esp32Connected and !configurationPublished[IRQ_PIN_index])
-      {
-        publishMqttConfigurations( IRQ_PIN_index);
-      }
-      /*
-        *  If bit in IRQ_PINs_stored matches the bit set in pinMask: Calculate powerconsumption and publist data.
-        */
-      if( IRQ_PINs_stored & pinMask)                       // If bit is set 
-      {
-        //   >>>>>>>>>>>>>>>>>>>>>>>>>>>  Calculate power comsumption   <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
-        /*
-          * It does not make sence to calculate consumption when the privious pulse is unkown (0) or 
-          * when millis() has owerflown and millsTimeStamp
-          * is before pulseTimeStamp.
-          * When millis overflows, the pulsetime (millsTimeStamp - pulseTimeStamp + pulseTimeCorrection) 
-          * could ofcause be calculated, but it brings complexity to the code 
-          * but only saves one comsumption calculation every 50 days...
-          */
-        long watt_consumption = 0;
-        if ( metaData[IRQ_PIN_index].pulseTimeStamp > 0 && metaData[IRQ_PIN_index].pulseTimeStamp < millsTimeStamp[IRQ_PIN_index])
-        { 
-          watt_consumption = round(((float)(60*60*1000) / 
-                                    (float)(millsTimeStamp[IRQ_PIN_index] - metaData[IRQ_PIN_index].pulseTimeStamp +
-                                    interfaceConfig.pulseTimeCorrection)) / 
-                                    (float)interfaceConfig.pulse_per_kWh[IRQ_PIN_index] * 1000);
-
-          metaData[IRQ_PIN_index].pulseLength = millsTimeStamp[IRQ_PIN_index] - metaData[IRQ_PIN_index].pulseTimeStamp +
-                                                interfaceConfig.pulseTimeCorrection;
-        }
-
-        //   >>>>>>>>>>>>>>>>>>>>>>>>>>>  Update meterData and publish totals   <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
-        
-        metaData[IRQ_PIN_index].pulseTimeStamp = millsTimeStamp[IRQ_PIN_index];
-        meterData[IRQ_PIN_index].pulseTotal++;
-        meterData[IRQ_PIN_index].pulseSubTotal++;
-
-        if ( !SD_Failed )
-        {
-          writeMeterData( IRQ_PIN_index);
-        }
-
-        if ( esp32Connected) {
-          publishSensorJson( watt_consumption, IRQ_PIN_index);
-        }
+    // Virtual meters follow every consumption, also consumptions held back by the deadband.
+    updateVirtualMeters( publishEvent.IRQ_PIN_index, publishEvent.watt_consumption, !publishEvent.pulse);
 
-        bitClear(IRQ_PINs_stored, IRQ_PIN_index);                 // Set the bit back to 0, ready for next IRQ 
-      } 
-      pinMask <<= 1;                                              // Left shift the bit mask to check the next bit
+    // Publish configuration to MQTT broker if not allready done.
+    if( esp32Connected and !configurationPublished[publishEvent.IRQ_PIN_index])
+    {
+      publishMqttConfigurations( publishEvent.IRQ_PIN_index);
     }
 
+    // Consumptions caused by pulses are held back by the deadband, but no longer than POWER_MAX_PUBLISH_INTERVAL.
+    if ( publishEvent.pulse && 
+         labs( publishEvent.watt_consumption - lastPublishedWatt[publishEvent.IRQ_PIN_index]) < PRIVATE_POWER_DEADBAND_W &&
+         sec() < lastPublishedAt[publishEvent.IRQ_PIN_index] + POWER_MAX_PUBLISH_INTERVAL)
+      continue;
+
+    if ( esp32Connected) {
+      lastPublishedWatt[publishEvent.IRQ_PIN_index] = publishEvent.watt_consumption;
+      lastPublishedAt[publishEvent.IRQ_PIN_index] = sec();
+      if ( publishEvent.pulseStoredAt > 0)
+        recordLatency( publishLatency[publishEvent.IRQ_PIN_index], esp_timer_get_time() - publishEvent.pulseStoredAt);
+      publishSensorJson( publishEvent.watt_consumption, publishEvent.IRQ_PIN_index, !publishEvent.pulse);
+    }
   }
 
-  /* >>>>>>>>>>>>>>>>>>    Pulse time check  <<<<<<<<<<<<<<<<<<<<<<<<<<
-
-   * If a bit in IRQ_PINs_stored is set or being set during the pulse time check, further pulse 
-   * time check's will be skipped because publishing meterData has priority.  
-   * If no bit's are set, check if then pulseTimeStamp indicate that comsumption has been 
-   * reduced or stopped.
-   * 
-   * The assumption is: If a pulse has been missing for double the previous pulse period, 
-   * comsumption has dropped and a new fictive comsumptino is published based on the double 
-   * of the previous pulse period.
-   * This will goes on, until the calculated fictive comsumptino becomes less than the consumption, 
-   * defined in MIN_CONSUMPTION.
-   */
-  unsigned long timeStamp = millis();
-  if ( GlobalIRQ_PIN_index >= PRIVATE_NO_OF_CHANNELS)
-    GlobalIRQ_PIN_index = 0;
+  // >>>>>>>>>>>>>>>>>>>>   Publish steps detected by the pulse task (If any)   <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+  stepEvent_t stepEvent;
+  while ( xQueueReceive( stepQueue, &stepEvent, 0) == pdTRUE)
+  {
+    if ( esp32Connected)
+      publishStepJson( &stepEvent);
+  }
 
-  while ( IRQ_PINs_stored == 0 && GlobalIRQ_PIN_index < PRIVATE_NO_OF_CHANNELS)
+  // Publish virtual meters with contributing channels changed. Once for all the events above.
+  if ( esp32Connected and virtualPending)
   {
-    // Publish configuration to MQTT broker if not allready done.
-    if( esp32Connected and !configurationPublished[GlobalIRQ_PIN_index])
+    for ( uint8_t virtualIndex = 0; virtualIndex < PRIVATE_NO_OF_VIRTUAL; virtualIndex++)
     {
-      publishMqttConfigurations( GlobalIRQ_PIN_index);
+      if ( bitRead( virtualPending, virtualIndex))
+        publishVirtualJson( virtualIndex);
     }
+    virtualPending = 0;
+  }
 
-    // At startup pulseTimeStamp will be 0 ==> Comsumptino unknown ==> No need to recalculation
-    if ( metaData[GlobalIRQ_PIN_index].pulseLength > 0 )
+  // Publish configuration to MQTT broker for channels without pulses and virtual meters, if not allready done.
+  if ( esp32Connected and configurationsPending)
+  {
+    for ( uint8_t ii = 0; ii < NO_OF_METERS; ii++)
     {
-      // During exeution mills will overflow ==> Complicates calculation ==> Skip recalculation
-      if ( metaData[GlobalIRQ_PIN_index].pulseTimeStamp > timeStamp)
+      if( !configurationPublished[ii])
       {
-        long watt_consumption = 0;
-        metaData[GlobalIRQ_PIN_index].pulseLength = 0;
-        if ( esp32Connected)
-          publishSensorJson( -1 * watt_consumption, GlobalIRQ_PIN_index);
-      }
-      else
-      {  
-        if (  metaData[GlobalIRQ_PIN_index].pulseTimeStamp + 
-              ( 2 * metaData[GlobalIRQ_PIN_index].pulseLength) < timeStamp )
-        {
-          long watt_consumption = round(((float)(60*60*1000) / 
-                                    (float)(timeStamp - metaData[GlobalIRQ_PIN_index].pulseTimeStamp + 
-                                    interfaceConfig.pulseTimeCorrection)) /
-                                    (float)interfaceConfig.pulse_per_kWh[GlobalIRQ_PIN_index] * 1000);
-
-          if ( watt_consumption < MIN_CONSUMPTION) {
-            watt_consumption = 0;
-            metaData[GlobalIRQ_PIN_index].pulseLength = 0;
-          }
-          if ( esp32Connected)
-            publishSensorJson( -1 * watt_consumption, GlobalIRQ_PIN_index);
-
-          metaData[GlobalIRQ_PIN_index].pulseLength *= 2;
-        }
+        publishMqttConfigurations( ii);
       }
     }
-    /* Tuggle LED Pin if tuggled and BLIP time has passed or millis() has overrun.
-    */
-    if ( LED_ToggledState )
+    configurationsPending = false;
+  }
+
+  /* Tuggle LED Pin if tuggled and BLIP time has passed.
+  */
+  if ( LED_ToggledState )
+  {
+    if ( esp_timer_get_time() > LED_toggledAt + (int64_t)blip * 1000)
     {
-      if ( millis() > LED_toggledAt + blip or millis() < LED_toggledAt)
-      {
-        digitalWrite(LED_BUILTIN, !digitalRead (LED_BUILTIN));
-        LED_ToggledState = false;
-        LED_toggledAt = 0;
-      }
+      digitalWrite(LED_BUILTIN, !digitalRead (LED_BUILTIN));
+      LED_ToggledState = false;
+      LED_toggledAt = 0;
     }
-
-    GlobalIRQ_PIN_index++;
   }
 
   /* >>>>>>>>>>>>>>>>>>>>>>>>>>> time check to scheculed Google update <<<<<<<<<<<<<<<<<<< */
@@ -772,12 +1199,15 @@ void loop()
                                  // Postpone a minute before getting next secondsToNextTimeCheck 
     if (PRIVATE_UPDATE_GOOGLE_SHEET and WiFi.status() == WL_CONNECTED)
       updateGoogleSheets( 0);
+    publishLoadDurations();
+    xSemaphoreTake( meterDataMutex, portMAX_DELAY);
     for ( uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
     {
       meterData[ii].pulseSubTotal = 0;
       if ( !SD_Failed )
         writeMeterData( ii);
     }
+    xSemaphoreGive( meterDataMutex);
   }
 
   if ( errorIndex != previousErrorIndex)
@@ -785,6 +1215,94 @@ void loop()
     publish_sketch_version();
     previousErrorIndex = errorIndex;
   } 
+
+  /* >>>>>>>>>>>>>>>>>>>>>>>>>>> Mask and unmask channels with interrupt storms <<<<<<<<<<<<<<<<<<< */
+  if ( stormMaskedPins != 0 || stormDetachedPins != 0)
+    handleInterruptStorms();
+
+  /* >>>>>>>>>>>>>>>>>>>>>>>>>>> Reconcile lost pulses and publish changed channel diagnostics <<<<<<<<<<<<<<<<<<< */
+  if ( sec() >= diagnosticsCheckedAt + DIAGNOSTICS_INTERVAL)
+  {
+    diagnosticsCheckedAt = sec();
+    for ( uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
+    {
+      // The pulse task drains the ring buffer with meterDataMutex taken, so no pulse is half way through meanwhile.
+      xSemaphoreTake( meterDataMutex, portMAX_DELAY);
+      unsigned long lostPulses = getLostPulses( ii);
+      if ( PRIVATE_RECONCILE_LOST_PULSES && lostPulses > reconciledPulses[ii])
+      {
+        unsigned long newlyLost = lostPulses - reconciledPulses[ii];
+        meterData[ii].pulseTotal += newlyLost;
+        meterData[ii].pulseSubTotal += newlyLost;
+
+        // The pulses were lost since the previous check, so they are credited to the current demand window, tariff, day,
+        // month and hour of the forecast profile. updateDemand() also starts a new day or hour, if one has begun.
+        updateDemand( ii, time(nullptr));
+        meterData[ii].demandPulses += newlyLost;
+        meterData[ii].tariffPulses[getTariff( time(nullptr))] += newlyLost;
+        meterData[ii].dayPulses += newlyLost;
+        meterData[ii].monthPulses += newlyLost;
+        forecastHourPulses[ii] += newlyLost;
+        reconciledPulses[ii] = lostPulses;
+        if ( !SD_Failed )
+          writeMeterData( ii);
+      }
+      xSemaphoreGive( meterDataMutex);
+
+      unsigned long diagnosticsSum = rejectedPulses[ii] + pulseRingOverflow[ii] + implausiblePulses[ii] + stormCount[ii] + 
+                                     lostPulses + publishDropped[ii];
+      if ( esp32Connected and diagnosticsSum != diagnosticsPublished[ii])
+      {
+        publishDiagnosticsJson( ii);
+        diagnosticsPublished[ii] = diagnosticsSum;
+      }
+    }
+  }
+
+  /* >>>>>>>>>>>>>>>>>>>>>>>>>>> Reconcile sub meters with their parent <<<<<<<<<<<<<<<<<<< */
+  if ( PRIVATE_SUBMETER_PARENT >= 0 and sec() >= subMeterCheckedAt + SUBMETER_INTERVAL)
+  {
+    subMeterCheckedAt = sec();
+    reconcileSubMeters();
+  }
+
+  /* >>>>>>>>>>>>>>>>>>>>>>>>>>> Publish latency histograms <<<<<<<<<<<<<<<<<<< */
+  if ( esp32Connected and sec() >= latencyPublishedAt + LATENCY_INTERVAL)
+  {
+    latencyPublishedAt = sec();
+    for ( uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
+      publishLatencyJson( ii);
+  }
+
+  /* >>>>>>>>>>>>>>>>>>>>>>>>>>> Publish minute aggregates <<<<<<<<<<<<<<<<<<< */
+  if ( time(nullptr) / 60 != aggregateMinute)
+  {
+    minuteAggregate_t minutes[PRIVATE_NO_OF_CHANNELS];
+    int64_t timeStamp = esp_timer_get_time();
+
+    xSemaphoreTake( meterDataMutex, portMAX_DELAY);
+    for ( uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
+    {
+      minutes[ii] = minuteAggregate[ii];
+      minuteAggregateReset( &minuteAggregate[ii]);
+
+      // End the demand window for channels without pulses since the window ended.
+      if ( updateDemand( ii, time(nullptr)) && !SD_Failed)
+        writeMeterData( ii);
+    }
+    xSemaphoreGive( meterDataMutex);
+
+    if ( esp32Connected)
+    {
+      for ( uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
+      {
+        publishMinuteJson( ii, &minutes[ii], timeStamp - aggregateMinuteStart);
+        publishDemandJson( ii);
+      }
+    }
+    aggregateMinute = time(nullptr) / 60;
+    aggregateMinuteStart = timeStamp;
+  }
 }
 /*
  * ###################################################################################################
@@ -896,9 +1414,10 @@ void writeMeterData(uint8_t datafileNumber)
  * The function will delite the old configuration file and create a new one.
  * It will skip all existing data file sets.
  * - int structureVersion;
- * - unsigned long pulseTimeCorrection;      // Used to calibrate the calculated consumption.
+ * - unsigned long pulseTimeCorrection;      // Used to calibrate the calculated consumption (milliseconds).
  * - uint16_t dataFileSetNumber;            // In which data file set ("directory") the data files will be located.
  * - uint16_t  pulse_per_kWh[PRIVATE_NO_OF_CHANNELS];       // Number of pulses as defined for each energy meter
+ * - uint8_t powerWindow[PRIVATE_NO_OF_CHANNELS];           // Number of pulse intervals the consumption is averaged over.
  */
 
 void setConfigurationDefaults()
@@ -924,7 +1443,10 @@ void setConfigurationDefaults()
   }
 
   for (uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
+  {
     interfaceConfig.pulse_per_kWh[ii] = private_default_pulse_per_kWh[ii];    // Number of pulses as defined for each energy meter
+    interfaceConfig.powerWindow[ii] = PRIVATE_POWER_WINDOW;
+  }
 
   if ( !SD_Failed)
   {
@@ -936,6 +1458,103 @@ void setConfigurationDefaults()
     writeConfigData();
   }
 }
+/* ###################################################################################################
+ *                     S E T   P U L S E   H O L D   O F F
+ * ###################################################################################################
+ * Calculate the minimum plausible time between two pulses for each channel from the maximum power of 
+ * the energy meter and the number of pulses per kWh. 
+ * Must be called whenever interfaceConfig.pulse_per_kWh[] has been changed.
+ */
+void setPulseHoldOff()
+{
+  for (uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
+  {
+    if ( private_max_power_W[ii] > 0 && interfaceConfig.pulse_per_kWh[ii] > 0)
+      pulseHoldOff[ii] = (60LL*60*1000000*1000) / ((uint64_t)interfaceConfig.pulse_per_kWh[ii] * private_max_power_W[ii]);
+    else
+      pulseHoldOff[ii] = 0;
+
+    // The interrupt storm limit follows the same physical limit. Each pulse gives two IRQ's (both edges).
+    if ( pulseHoldOff[ii] > 0)
+      stormLimit[ii] = STORM_MARGIN * 2 * (STORM_WINDOW / pulseHoldOff[ii] + 1);
+    else
+      stormLimit[ii] = STORM_DEFAULT_LIMIT;
+  }
+}
+/* ###################################################################################################
+ *                     S E T   C O N S U M P T I O N   E N G I N E S
+ * ###################################################################################################
+ * Calculate the constants used by the consumption calculation for each channel, and empty the power windows.
+ * Must be called whenever interfaceConfig.pulse_per_kWh[], interfaceConfig.pulseTimeCorrection or 
+ * interfaceConfig.powerWindow[] has been changed.
+ * pulseTimeCorrection is configured in milliseconds.
+ */
+void setConsumptionEngines()
+{
+  for (uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
+  {
+    consumptionEngineInit( &consumptionEngine[ii], interfaceConfig.pulse_per_kWh[ii], 
+                           (int64_t)interfaceConfig.pulseTimeCorrection * 1000);
+    powerWindowInit( &powerWindow[ii], interfaceConfig.powerWindow[ii]);
+  }
+}
+
+/* ###################################################################################################
+ *                     H A N D L E   I N T E R R U P T   S T O R M S
+ * ###################################################################################################
+ * Called from loop() when a channel is masked by the ISR or detached.
+ * - A channel masked by the ISR is detached, so it does not load the CPU any more. The channel will be masked for 
+ *   stormBackoff[] seconds. The backoff is doubled for every storm, up till STORM_BACKOFF_MAX, and is reset to 
+ *   STORM_BACKOFF_MIN when the channel has been running without storms for STORM_BACKOFF_MAX seconds.
+ * - When the backoff time has passed, the channel is unmasked and re-attached.
+ * Only the masked channel is affected. The other channels keep counting.
+ */
+void handleInterruptStorms()
+{
+  uint32_t newlyMasked = stormMaskedPins & ~stormDetachedPins;
+  while ( newlyMasked)
+  {
+    uint8_t ii = __builtin_ctz(newlyMasked);
+    newlyMasked &= newlyMasked - 1;
+
+    detachInterrupt(channelPin[ii]);
+    bitSet(stormDetachedPins, ii);
+    stormCount[ii]++;
+
+    if ( stormBackoff[ii] == 0 || sec() > stormAttachedAt[ii] + STORM_BACKOFF_MAX)
+      stormBackoff[ii] = STORM_BACKOFF_MIN;
+    else if ( stormBackoff[ii] < STORM_BACKOFF_MAX)
+      stormBackoff[ii] = min( 2 * stormBackoff[ii], (unsigned long)STORM_BACKOFF_MAX);
+    stormMaskedAt[ii] = sec();
+
+    if ( esp32Connected)
+      publishDiagnosticsJson( ii);
+  }
+
+  uint32_t detached = stormDetachedPins;
+  while ( detached)
+  {
+    uint8_t ii = __builtin_ctz(detached);
+    detached &= detached - 1;
+
+    if ( sec() >= stormMaskedAt[ii] + stormBackoff[ii])
+    {
+      stormIRQs[ii] = 0;
+      stormWindowStart[ii] = esp_timer_get_time();
+      pulseRiseTime[ii] = 0;
+      portENTER_CRITICAL(&pulseRingMux);
+      bitClear(stormMaskedPins, ii);
+      portEXIT_CRITICAL(&pulseRingMux);
+      bitClear(stormDetachedPins, ii);
+      stormAttachedAt[ii] = sec();
+      attachInterruptArg(channelPin[ii], Ext_INT_ISR, (void *)(uintptr_t)ii, CHANGE);
+
+      if ( esp32Connected)
+        publishDiagnosticsJson( ii);
+    }
+  }
+}
+
 /* ###################################################################################################
  *                     I N I T I A L I Z E   G L O B A L S
  * ###################################################################################################
@@ -945,11 +1564,92 @@ void initializeGlobals()
   for (uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
   {
     metaData[ii].pulseTimeStamp = 0;
-    metaData[ii].pulseLength = 0;
+    metaData[ii].decayWatt = 0;
+    metaData[ii].decayAt = 0;
+
+    pulseRingHead[ii] = 0;
+    pulseRingTail[ii] = 0;
+    pulseRingOverflow[ii] = 0;
+
+    minPulseWidth[ii] = (uint32_t)private_min_pulse_width_ms[ii] * 1000;
+    maxPulseWidth[ii] = (uint32_t)private_max_pulse_width_ms[ii] * 1000;
+    pulseRiseTime[ii] = 0;
+    rejectedPulses[ii] = 0;
+    pulseHoldOff[ii] = 0;
+    lastPulseTime[ii] = 0;
+    implausiblePulses[ii] = 0;
+
+    stormLimit[ii] = STORM_DEFAULT_LIMIT;
+    stormWindowStart[ii] = 0;
+    stormIRQs[ii] = 0;
+    stormMaskedAt[ii] = 0;
+    stormAttachedAt[ii] = 0;
+    stormBackoff[ii] = 0;
+    stormCount[ii] = 0;
+
+    rawPulses[ii] = 0;
+    processedPulses[ii] = 0;
+    reconciledPulses[ii] = 0;
+    diagnosticsPublished[ii] = 0;
+    publishDropped[ii] = 0;
+    lastPublishedWatt[ii] = 0;
+    lastPublishedAt[ii] = 0;
+    countMode[ii] = false;
+    countWindowStart[ii] = 0;
+    countWindowReference[ii] = 0;
+    countWindowPulses[ii] = 0;
+
+    pulseStoredAt[ii] = 0;
+    for ( uint8_t bin = 0; bin < LATENCY_BINS; bin++)
+    {
+      publishLatency[ii][bin] = 0;
+      sdLatency[ii][bin] = 0;
+    }
+
+    for ( uint8_t bin = 0; bin < LOAD_DURATION_BINS; bin++)
+      loadDuration[ii][bin] = 0;
+    loadDurationAt[ii] = 0;
+
+    channelWatt[ii] = 0;
+
+    for ( uint8_t hour = 0; hour < BASELOAD_HOURS; hour++)
+      baseloadSlot[ii][hour] = BASELOAD_NONE;
+    baseloadHour[ii] = 0;
+    baseloadFirstWindow[ii] = 0;
+
+    for ( uint8_t hour = 0; hour < 24; hour++)
+      forecastProfile[ii][hour] = 0;
+    forecastLearned[ii] = 0;
+    forecastHour[ii] = 0;
+    forecastFirstHour[ii] = 0;
+    forecastHourPulses[ii] = 0;
 
-    // >>>>>>>>>>    Set flag for publishing HA configuration   <<<<<<<<<<<<< 
+    stepDetectorInit( &stepDetector[ii], STEP_MIN_PERCENT, STEP_THRESHOLD_FACTOR);
+  }
+
+  // >>>>>>>>>>    Set flag for publishing HA configuration   <<<<<<<<<<<<< 
+  for (uint8_t ii = 0; ii < NO_OF_METERS; ii++)
     configurationPublished[ii] = false;
+  configurationsPending = true;
+
+  // >>>>>>>>>>    Find the channels contributing to each virtual meter   <<<<<<<<<<<<< 
+  for (uint8_t virtualIndex = 0; virtualIndex < PRIVATE_NO_OF_VIRTUAL; virtualIndex++)
+  {
+    virtualChannels[virtualIndex] = 0;
+    for (uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
+    {
+      if ( private_virtualCoefficients[virtualIndex][ii] != 0)
+        bitSet( virtualChannels[virtualIndex], ii);
+    }
   }
+  channelEstimated = 0;
+  virtualPending = 0;
+  deadlineQueueInit( &channelDeadlines);
+
+  for (uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
+    minuteAggregateReset( &minuteAggregate[ii]);
+  aggregateMinute = time(nullptr) / 60;
+  aggregateMinuteStart = esp_timer_get_time();
 
   // >>>>>>>>>>>>>   Set globals for MQTT Device and Client   <<<<<<<<<<<<<<<<<<
   uint8_t mac[6];
@@ -1039,6 +1739,8 @@ bool updateGoogleSheets( uint8_t messageIndex)
   // >>>>>>>>>>>>>   Create data-URL string for HTTP request   <<<<<<<<<<<<<<<<<<
   String urlData = "/exec?meterData=";
 
+  // meterData[] is updated by the pulse task. Hold the mutex while the values are copied, but not during the HTTP request.
+  xSemaphoreTake( meterDataMutex, portMAX_DELAY);
   for ( uint8_t IRQ_PIN_index = 0; IRQ_PIN_index < PRIVATE_NO_OF_CHANNELS; IRQ_PIN_index++)
     urlData += String( float(meterData[IRQ_PIN_index].pulseTotal) / float(interfaceConfig.pulse_per_kWh[IRQ_PIN_index]), 2) + ",";
   
@@ -1049,6 +1751,15 @@ bool updateGoogleSheets( uint8_t messageIndex)
       urlData += String(",");
   }
 
+  // Tariff registers for each channel, tariff by tariff. Left out with a single tariff, so the row is unchanged.
+  if ( PRIVATE_NO_OF_TARIFFS > 1)
+  {
+    for ( uint8_t IRQ_PIN_index = 0; IRQ_PIN_index < PRIVATE_NO_OF_CHANNELS; IRQ_PIN_index++)
+      for ( uint8_t tariff = 0; tariff < PRIVATE_NO_OF_TARIFFS; tariff++)
+        urlData += "," + String( float(meterData[IRQ_PIN_index].tariffPulses[tariff]) / float(interfaceConfig.pulse_per_kWh[IRQ_PIN_index]), 2);
+  }
+  xSemaphoreGive( meterDataMutex);
+
   if ( messageIndex == 1)
     urlData += String(",PowerUp");
   if ( messageIndex == 2)
@@ -1217,6 +1928,7 @@ unsigned long sec()
  * 
  * component can take the values: "sensor" or "number"
  * device_class can take the values "energy" or "power"
+ * stateSuffix is the suffix of the state topic holding the value: MQTT_SUFFIX_STATE or MQTT_SUFFIX_DEMAND
 */
 /*  Eksempel på Topic og Payload for MQTT sensor integration, deviceClass = "energy":
  *  Where : Component = MQTT_SENSOR_COMPONENT and PIN_reference = 0
@@ -1292,11 +2004,16 @@ Payload:
   "Total" : "789"
 }
  */
-void publishMqttEnergyConfigJson( String component, String entityName, String unitOfMesurement, String deviceClass, u_int8_t PIN_reference)
+void publishMqttEnergyConfigJson( String component, String entityName, String unitOfMesurement, String deviceClass, u_int8_t PIN_reference,
+                                  String stateSuffix)
 {
   uint8_t payload[1024];
   JsonDocument doc;
-  String energyMeter = String( private_energyMeters[PIN_reference]);
+  String energyMeter;
+  if ( PIN_reference < PRIVATE_NO_OF_CHANNELS)
+    energyMeter = String( private_energyMeters[PIN_reference]);
+  else
+    energyMeter = String( private_virtualMeters[PIN_reference - PRIVATE_NO_OF_CHANNELS]);
 
   if ( component == MQTT_NUMBER_COMPONENT & deviceClass == MQTT_ENERGY_DEVICECLASS)
   {
@@ -1307,7 +2024,7 @@ void publishMqttEnergyConfigJson( String component, String entityName, String un
     doc["step"] = 0.01;
   }
   doc["name"] = entityName;
-  doc["state_topic"] = String(MQTT_DISCOVERY_PREFIX + MQTT_PREFIX + MQTT_PREFIX_DEVICE + PIN_reference + MQTT_SUFFIX_STATE);
+  doc["state_topic"] = String(MQTT_DISCOVERY_PREFIX + MQTT_PREFIX + MQTT_PREFIX_DEVICE + PIN_reference + stateSuffix);
   doc["availability_topic"] = String(MQTT_PREFIX + mqttDeviceNameWithMac + MQTT_ONLINE);
   doc["payload_available"] = "True";
   doc["payload_not_available"] = "False";
@@ -1321,13 +2038,25 @@ void publishMqttEnergyConfigJson( String component, String entityName, String un
   else 
     doc["value_template"] = String("{{ value_json." + entityName + " | round(2)}}");
 
+  if ( entityName == MQTT_SENSOR_POWER_ENTITYNAME)
+  {
+    // Show if the consumption is estimated as an attribute of the power sensor.
+    doc["json_attributes_topic"] = doc["state_topic"];
+    doc["json_attributes_template"] = String("{\"" + MQTT_POWER_ESTIMATED + "\": {{ value_json." + MQTT_POWER_ESTIMATED + " | tojson }} }");
+  }
+
   JsonObject device = doc["device"].to<JsonObject>();
 
   device["identifiers"][0] = String(MQTT_PREFIX_DEVICE + PIN_reference);
   device["name"] = String("Energi - " + energyMeter);
 
   size_t length = serializeJson(doc, payload);
-  String energyTopic = String( MQTT_DISCOVERY_PREFIX + component + "/" + deviceClass + "/" + MQTT_PREFIX_DEVICE + PIN_reference + "/config");
+  // Entities of virtual meters and entities on other state topics have the entity name in the object id, as they share
+  // component and device class with other entities of the energy meter.
+  String objectId = String( MQTT_PREFIX_DEVICE + PIN_reference);
+  if ( stateSuffix != MQTT_SUFFIX_STATE || PIN_reference >= PRIVATE_NO_OF_CHANNELS)
+    objectId += String( "_" + entityName);
+  String energyTopic = String( MQTT_DISCOVERY_PREFIX + component + "/" + deviceClass + "/" + objectId + "/config");
 
   mqttClient.publish(energyTopic.c_str(), payload, length, UNRETAINED);
 }
@@ -1338,9 +2067,27 @@ void publishMqttEnergyConfigJson( String component, String entityName, String un
 */
 void publishMqttConfigurations( uint8_t device) {
 
-  publishMqttEnergyConfigJson(MQTT_SENSOR_COMPONENT, MQTT_SENSOR_ENERG_ENTITYNAME, "kWh", MQTT_ENERGY_DEVICECLASS, device);
-  publishMqttEnergyConfigJson(MQTT_SENSOR_COMPONENT, MQTT_SENSOR_POWER_ENTITYNAME, "W", MQTT_POWER_DEVICECLASS, device);
-  publishMqttEnergyConfigJson(MQTT_NUMBER_COMPONENT, MQTT_NUMBER_ENERG_ENTITYNAME, "kWh", MQTT_ENERGY_DEVICECLASS, device);
+  // Virtual meters can not be preset, so the total is a sensor. Demand is not calculated for virtual meters.
+  if ( device >= PRIVATE_NO_OF_CHANNELS)
+  {
+    publishMqttEnergyConfigJson(MQTT_SENSOR_COMPONENT, MQTT_SENSOR_ENERG_ENTITYNAME, "kWh", MQTT_ENERGY_DEVICECLASS, device, MQTT_SUFFIX_STATE);
+    publishMqttEnergyConfigJson(MQTT_SENSOR_COMPONENT, MQTT_SENSOR_POWER_ENTITYNAME, "W", MQTT_POWER_DEVICECLASS, device, MQTT_SUFFIX_STATE);
+    publishMqttEnergyConfigJson(MQTT_SENSOR_COMPONENT, MQTT_NUMBER_ENERG_ENTITYNAME, "kWh", MQTT_ENERGY_DEVICECLASS, device, MQTT_SUFFIX_STATE);
+    configurationPublished[device] = true;
+    return;
+  }
+
+  publishMqttEnergyConfigJson(MQTT_SENSOR_COMPONENT, MQTT_SENSOR_ENERG_ENTITYNAME, "kWh", MQTT_ENERGY_DEVICECLASS, device, MQTT_SUFFIX_STATE);
+  publishMqttEnergyConfigJson(MQTT_SENSOR_COMPONENT, MQTT_SENSOR_POWER_ENTITYNAME, "W", MQTT_POWER_DEVICECLASS, device, MQTT_SUFFIX_STATE);
+  publishMqttEnergyConfigJson(MQTT_NUMBER_COMPONENT, MQTT_NUMBER_ENERG_ENTITYNAME, "kWh", MQTT_ENERGY_DEVICECLASS, device, MQTT_SUFFIX_STATE);
+
+  publishMqttEnergyConfigJson(MQTT_SENSOR_COMPONENT, MQTT_DEMAND_WINDOW_ENTITYNAME, "kWh", MQTT_ENERGY_DEVICECLASS, device, MQTT_SUFFIX_DEMAND);
+  publishMqttEnergyConfigJson(MQTT_SENSOR_COMPONENT, MQTT_DEMAND_ENTITYNAME, "W", MQTT_POWER_DEVICECLASS, device, MQTT_SUFFIX_DEMAND);
+  publishMqttEnergyConfigJson(MQTT_SENSOR_COMPONENT, MQTT_DEMAND_DAY_ENTITYNAME, "W", MQTT_POWER_DEVICECLASS, device, MQTT_SUFFIX_DEMAND);
+  publishMqttEnergyConfigJson(MQTT_SENSOR_COMPONENT, MQTT_DEMAND_MONTH_ENTITYNAME, "W", MQTT_POWER_DEVICECLASS, device, MQTT_SUFFIX_DEMAND);
+  publishMqttEnergyConfigJson(MQTT_SENSOR_COMPONENT, MQTT_BASELOAD_ENTITYNAME, "W", MQTT_POWER_DEVICECLASS, device, MQTT_SUFFIX_DEMAND);
+  publishMqttEnergyConfigJson(MQTT_SENSOR_COMPONENT, MQTT_FORECAST_DAY_ENTITYNAME, "kWh", MQTT_ENERGY_DEVICECLASS, device, MQTT_SUFFIX_DEMAND);
+  publishMqttEnergyConfigJson(MQTT_SENSOR_COMPONENT, MQTT_FORECAST_MONTH_ENTITYNAME, "kWh", MQTT_ENERGY_DEVICECLASS, device, MQTT_SUFFIX_DEMAND);
 
   configurationPublished[device] = true;
 }
@@ -1355,17 +2102,26 @@ Payload:
 {
 	"Subtotal" : "123",
   "Forbrug" : "456",
-  "Total" : "789"
+  "Total" : "789",
+  "Estimated" : false,
+  "Peak" : "512",                 // Tariff registers. Only when more than one tariff is defined.
+  "OffPeak" : "277"
 } 
 */
-void publishSensorJson( long powerConsumption, uint8_t IRQ_PIN_index)
+void publishSensorJson( long powerConsumption, uint8_t IRQ_PIN_index, bool estimated)
 {
-  uint8_t payload[256];
+  uint8_t payload[512];
   JsonDocument doc;
 
   doc[MQTT_SENSOR_ENERG_ENTITYNAME] = float(meterData[IRQ_PIN_index].pulseSubTotal) / float(interfaceConfig.pulse_per_kWh[IRQ_PIN_index]);
   doc[MQTT_SENSOR_POWER_ENTITYNAME] = powerConsumption;
   doc[MQTT_NUMBER_ENERG_ENTITYNAME] = float(meterData[IRQ_PIN_index].pulseTotal) / float(interfaceConfig.pulse_per_kWh[IRQ_PIN_index]);
+  doc[MQTT_POWER_ESTIMATED] = estimated;
+  if ( PRIVATE_NO_OF_TARIFFS > 1)
+  {
+    for ( uint8_t tariff = 0; tariff < PRIVATE_NO_OF_TARIFFS; tariff++)
+      doc[private_tariffNames[tariff]] = float(meterData[IRQ_PIN_index].tariffPulses[tariff]) / float(interfaceConfig.pulse_per_kWh[IRQ_PIN_index]);
+  }
 
   size_t length = serializeJson(doc, payload);
   String sensorTopic = String(MQTT_DISCOVERY_PREFIX + MQTT_PREFIX + MQTT_PREFIX_DEVICE + IRQ_PIN_index + MQTT_SUFFIX_STATE);
@@ -1374,48 +2130,783 @@ void publishSensorJson( long powerConsumption, uint8_t IRQ_PIN_index)
 }
 /*
  * ###################################################################################################
- *                       M Q T T   C A L L B A C K  
+ *                       P U B L I S H   D E M A N D   J S O N
  * ###################################################################################################
- */;/*
- * For more information about MQTT, visit: https://mqtt.org/
- * For more information about pubsubclient, mqttCallback, visit:
- * - https://pubsubclient.knolleary.net/
- * - https://pubsubclient.knolleary.net/api
- * - https://arduinojson.org
- * The function gets a IRQ pin reference number from the topic and
- * handles messages with the folowing suffixes:
- */
-void mqttCallback(char* topic, byte* payload, unsigned int length)
+*/
+/*  Eksempel på Topic og Payload for opdatering af demand registers
+Topic_ homeassistant/energy/meter_0/demand
+Payload:
 {
-  JsonDocument doc;                         // 
-  byte IRQ_PIN_reference = 0;
-  String topicString = String(topic);
+  "DemandWindow" : 0.35,
+  "Demand" : 1520,
+  "DemandToday" : 3480,
+  "DemandMonth" : 6120,
+  "Baseload" : 145,
+  "ForecastToday" : 14.62,
+  "ForecastMonth" : 402.80
+} 
+"Baseload" is left out, until a demand window has ended. The forecasts are left out, until NTP time is set.
+*/
+void publishDemandJson( uint8_t IRQ_PIN_index)
+{
+  uint8_t payload[256];
+  JsonDocument doc;
 
-  if( topicString.startsWith(MQTT_PREFIX))
+  xSemaphoreTake( meterDataMutex, portMAX_DELAY);
+  doc[MQTT_DEMAND_WINDOW_ENTITYNAME] = float(meterData[IRQ_PIN_index].demandPulses) / float(interfaceConfig.pulse_per_kWh[IRQ_PIN_index]);
+  doc[MQTT_DEMAND_ENTITYNAME] = meterData[IRQ_PIN_index].demandPrevious;
+  doc[MQTT_DEMAND_DAY_ENTITYNAME] = meterData[IRQ_PIN_index].demandMaxDay;
+  doc[MQTT_DEMAND_MONTH_ENTITYNAME] = meterData[IRQ_PIN_index].demandMaxMonth;
+  long baseload = getBaseload( IRQ_PIN_index);
+  if ( baseload >= 0)
+    doc[MQTT_BASELOAD_ENTITYNAME] = baseload;
+  float forecastDay, forecastMonth;
+  if ( getForecast( IRQ_PIN_index, time(nullptr), &forecastDay, &forecastMonth))
   {
-    IRQ_PIN_reference = getIRQ_PIN_reference(topic);
+    doc[MQTT_FORECAST_DAY_ENTITYNAME] = forecastDay;
+    doc[MQTT_FORECAST_MONTH_ENTITYNAME] = forecastMonth;
   }
+  xSemaphoreGive( meterDataMutex);
 
-  if ( topicString.endsWith(MQTT_SUFFIX_TOTAL_TRESHOLD))
+  size_t length = serializeJson(doc, payload);
+  String demandTopic = String(MQTT_DISCOVERY_PREFIX + MQTT_PREFIX + MQTT_PREFIX_DEVICE + IRQ_PIN_index + MQTT_SUFFIX_DEMAND);
+
+  mqttClient.publish(demandTopic.c_str(), payload, length, UNRETAINED);
+}
+/*
+ * ###################################################################################################
+ *                       U P D A T E   V I R T U A L   M E T E R S
+ * ###################################################################################################
+ * Register the consumption queued for publishing for a channel, and mark the virtual meters it contributes to for 
+ * publishing. Virtual meters without the channel are not touched.
+ */
+void updateVirtualMeters( uint8_t IRQ_PIN_index, long watt_consumption, bool estimated)
+{
+  channelWatt[IRQ_PIN_index] = watt_consumption;
+  if ( estimated)
+    bitSet( channelEstimated, IRQ_PIN_index);
+  else
+    bitClear( channelEstimated, IRQ_PIN_index);
+
+  for ( uint8_t virtualIndex = 0; virtualIndex < PRIVATE_NO_OF_VIRTUAL; virtualIndex++)
   {
-    deserializeJson(doc, payload, length);
-    meterData[IRQ_PIN_reference].pulseTotal = long(float(doc[MQTT_NUMBER_ENERG_ENTITYNAME]) * float(interfaceConfig.pulse_per_kWh[IRQ_PIN_reference]));
-    long watt_consumption = 0;
-    publishSensorJson( watt_consumption, IRQ_PIN_reference);
+    if ( bitRead( virtualChannels[virtualIndex], IRQ_PIN_index))
+      bitSet( virtualPending, virtualIndex);
   }
-  else if ( topicString.endsWith(MQTT_SUFFIX_CONFIG))
+}
+/*
+ * ###################################################################################################
+ *                       P U B L I S H   V I R T U A L   J S O N
+ * ###################################################################################################
+ * Publish the state of a virtual meter in the same format as an energy meter (see publishSensorJson()).
+ * Only the channels contributing to the virtual meter are evaluated. The consumption is estimated, if the consumption
+ * of any contributing channel is estimated.
+ */
+/*  Eksempel på Topic og Payload for virtual meter 0 with PRIVATE_NO_OF_CHANNELS = 8
+Topic_ homeassistant/energy/meter_8/state
+Payload:
+{
+  "Subtotal" : "123",
+  "Forbrug" : "456",
+  "Total" : "789",
+  "Estimated" : false
+} 
+*/
+void publishVirtualJson( uint8_t virtualIndex)
+{
+  uint8_t payload[256];
+  JsonDocument doc;
+  float watt = 0;
+  float subTotal = 0;
+  float total = 0;
+
+  xSemaphoreTake( meterDataMutex, portMAX_DELAY);
+  uint32_t channels = virtualChannels[virtualIndex];
+  while ( channels)
   {
-    /* Set pulse time correction in milliseconds. Done by:
-    * Publish: {"pulscorr" : 25}
-    * To topic: energy/monitor_ESP32_48E72997D320/config
-    */
+    uint8_t ii = __builtin_ctz(channels);
+    channels &= channels - 1;
+
+    float coefficient = private_virtualCoefficients[virtualIndex][ii];
+    watt += coefficient * channelWatt[ii];
+    subTotal += coefficient * float(meterData[ii].pulseSubTotal) / float(interfaceConfig.pulse_per_kWh[ii]);
+    total += coefficient * float(meterData[ii].pulseTotal) / float(interfaceConfig.pulse_per_kWh[ii]);
+  }
+  xSemaphoreGive( meterDataMutex);
+
+  doc[MQTT_SENSOR_ENERG_ENTITYNAME] = subTotal;
+  doc[MQTT_SENSOR_POWER_ENTITYNAME] = lroundf( watt);
+  doc[MQTT_NUMBER_ENERG_ENTITYNAME] = total;
+  doc[MQTT_POWER_ESTIMATED] = ( channelEstimated & virtualChannels[virtualIndex]) != 0;
+
+  size_t length = serializeJson(doc, payload);
+  String sensorTopic = String(MQTT_DISCOVERY_PREFIX + MQTT_PREFIX + MQTT_PREFIX_DEVICE + (PRIVATE_NO_OF_CHANNELS + virtualIndex) + MQTT_SUFFIX_STATE);
+
+  mqttClient.publish(sensorTopic.c_str(), payload, length, UNRETAINED);
+}
+/*
+ * ###################################################################################################
+ *                       R E C O N C I L E   S U B   M E T E R S
+ * ###################################################################################################
+ * Take a snapshot of the energy of the parent (PRIVATE_SUBMETER_PARENT) and the sum of its sub meters 
+ * (private_subMeterChild) from the totals, and compare the energy used within the rolling window.
+ * The unexplained difference (parent minus sub meters) is published. When it exceeds PRIVATE_SUBMETER_ALERT_PERCENT
+ * of the parent, the alert is set, and a status message is published when the alert is raised.
+ * Works on the totals only, so pulses are not affected.
+ */
+void reconcileSubMeters()
+{
+  int64_t parent = 0;
+  int64_t children = 0;
+
+  xSemaphoreTake( meterDataMutex, portMAX_DELAY);
+  for ( uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
+  {
+    if ( interfaceConfig.pulse_per_kWh[ii] == 0)
+      continue;
+    int64_t milliWh = (int64_t)meterData[ii].pulseTotal * 1000000 / interfaceConfig.pulse_per_kWh[ii];
+    if ( ii == PRIVATE_SUBMETER_PARENT)
+      parent = milliWh;
+    else if ( private_subMeterChild[ii])
+      children += milliWh;
+  }
+  xSemaphoreGive( meterDataMutex);
+
+  // A total preset through MQTT makes the window meaningless. Start a new window.
+  uint8_t latest = (subMeterNext + SUBMETER_SAMPLES) % (SUBMETER_SAMPLES + 1);
+  if ( subMeterCount > 0 && ( parent < subMeterParent[latest] || children < subMeterChildren[latest]))
+    subMeterCount = 0;
+
+  subMeterParent[subMeterNext] = parent;
+  subMeterChildren[subMeterNext] = children;
+  subMeterNext = (subMeterNext + 1) % (SUBMETER_SAMPLES + 1);
+  if ( subMeterCount < SUBMETER_SAMPLES + 1)
+    subMeterCount++;
+
+  if ( subMeterCount < SUBMETER_SAMPLES + 1)      // The window is not filled yet
+    return;
+
+  // subMeterNext is now the oldest snapshot.
+  int64_t parentWindow = parent - subMeterParent[subMeterNext];
+  int64_t childrenWindow = children - subMeterChildren[subMeterNext];
+  int64_t unexplained = parentWindow - childrenWindow;
+
+  bool alert = parentWindow >= (int64_t)SUBMETER_MIN_WH * 1000 && 
+               llabs( unexplained) * 100 > (int64_t)PRIVATE_SUBMETER_ALERT_PERCENT * parentWindow;
+  if ( alert && !subMeterAlert && esp32Connected)
+    publishStatusMessage( String( "Sub meter alert: " + String( float(unexplained) / 1000, 1) + " Wh of " + 
+                                  String( float(parentWindow) / 1000, 1) + " Wh unexplained"));
+  subMeterAlert = alert;
+
+  if ( esp32Connected)
+    publishSubMetersJson( parentWindow, childrenWindow);
+}
+/*
+ * ###################################################################################################
+ *                       P U B L I S H   S U B   M E T E R S   J S O N
+ * ###################################################################################################
+*/
+/*  Eksempel på Topic og Payload for sub meter reconciliation
+Topic: energy/monitor_ESP32_48E72997D320/submeters
+Payload:
+{
+  "parent" : 2450.0,
+  "children" : 2310.0,
+  "unexplained" : 140.0,
+  "percent" : 5.7,
+  "alert" : false
+}
+Energy (Wh) used within the rolling window.
+*/
+void publishSubMetersJson( int64_t parentWindow, int64_t childrenWindow)
+{
+  uint8_t payload[256];
+  JsonDocument doc;
+
+  doc[MQTT_SUBMETER_PARENT] = float(parentWindow) / 1000;
+  doc[MQTT_SUBMETER_CHILDREN] = float(childrenWindow) / 1000;
+  doc[MQTT_SUBMETER_UNEXPLAINED] = float(parentWindow - childrenWindow) / 1000;
+  doc[MQTT_SUBMETER_PERCENT] = parentWindow > 0 ? float(parentWindow - childrenWindow) * 100 / float(parentWindow) : 0;
+  doc[MQTT_SUBMETER_ALERT] = subMeterAlert;
+
+  size_t length = serializeJson(doc, payload);
+  String subMetersTopic = String(MQTT_PREFIX + mqttDeviceNameWithMac + MQTT_SUFFIX_SUBMETERS);
+
+  mqttClient.publish(subMetersTopic.c_str(), payload, length, RETAINED);
+}
+/*
+ * ###################################################################################################
+ *                       U P D A T E   D E M A N D
+ * ###################################################################################################
+ * Start a new demand window, if the window (time() / DEMAND_WINDOW) has changed. The demand of the window ended is
+ * the average consumption within it. It becomes the previous demand, and updates the maximum of the day and month 
+ * it belongs to. If windows without pulses have passed in between, the previous demand is 0.
+ * Returns true if a new window has been started. Nothing is done until NTP time is set.
+ * Constant time. Must be called with meterDataMutex taken.
+ */
+bool updateDemand( uint8_t IRQ_PIN_index, time_t now)
+{
+  if ( now < TIME_SET_EPOCH)
+    return false;
+
+  updateForecast( IRQ_PIN_index, now);
+
+  data_t * data = &meterData[IRQ_PIN_index];
+  uint32_t window = now / DEMAND_WINDOW;
+  if ( window == data->demandWindow)
+    return false;
+
+  if ( data->demandWindow != 0 && interfaceConfig.pulse_per_kWh[IRQ_PIN_index] > 0)
+  {
+    // Pulses * 1000 / pulse_per_kWh is Wh, and Wh * 3600 / DEMAND_WINDOW is the average in W.
+    uint32_t demand = ((uint64_t)data->demandPulses * 3600000 + (uint64_t)interfaceConfig.pulse_per_kWh[IRQ_PIN_index] * DEMAND_WINDOW / 2) /
+                      ((uint64_t)interfaceConfig.pulse_per_kWh[IRQ_PIN_index] * DEMAND_WINDOW);
+
+    checkDemandPeriod( IRQ_PIN_index, (time_t)data->demandWindow * DEMAND_WINDOW);
+    if ( demand > data->demandMaxDay)
+      data->demandMaxDay = demand;
+    if ( demand > data->demandMaxMonth)
+      data->demandMaxMonth = demand;
+    data->demandPrevious = window == data->demandWindow + 1 ? demand : 0;
+
+    if ( data->demandWindow != baseloadFirstWindow[IRQ_PIN_index])
+      updateBaseload( IRQ_PIN_index, data->demandWindow, demand);
+    if ( window > data->demandWindow + 1)
+      updateBaseload( IRQ_PIN_index, data->demandWindow + 1, 0);   // Windows without pulses have passed.
+  }
+  else
+    baseloadFirstWindow[IRQ_PIN_index] = window;
+
+  data->demandWindow = window;
+  data->demandPulses = 0;
+  checkDemandPeriod( IRQ_PIN_index, now);
+  return true;
+}
+/*
+ * ###################################################################################################
+ *                       U P D A T E   B A S E L O A D
+ * ###################################################################################################
+ * Register the demand of an ended demand window in the slot for the hour of the window. When a new hour is reached, 
+ * the slots of the hours passed since the latest update are cleared, as they hold demands from 24 hours ago.
+ * Must be called with meterDataMutex taken.
+ */
+void updateBaseload( uint8_t IRQ_PIN_index, uint32_t window, uint32_t demand)
+{
+  uint32_t hour = (uint64_t)window * DEMAND_WINDOW / 3600;
+  if ( hour != baseloadHour[IRQ_PIN_index])
+  {
+    uint32_t hoursPassed = hour - baseloadHour[IRQ_PIN_index];
+    if ( baseloadHour[IRQ_PIN_index] == 0 || hoursPassed > BASELOAD_HOURS)   // Also when time has been set back
+      hoursPassed = BASELOAD_HOURS;
+    for ( uint32_t passed = 0; passed < hoursPassed; passed++)
+      baseloadSlot[IRQ_PIN_index][(hour - passed) % BASELOAD_HOURS] = BASELOAD_NONE;
+    baseloadHour[IRQ_PIN_index] = hour;
+  }
+
+  uint32_t * slot = &baseloadSlot[IRQ_PIN_index][hour % BASELOAD_HOURS];
+  if ( demand < *slot)
+    *slot = demand;
+}
+/*
+ * ###################################################################################################
+ *                       G E T   B A S E L O A D
+ * ###################################################################################################
+ * Returns the lowest demand (W) within the latest BASELOAD_HOURS hours, or -1 if no demand window has ended yet.
+ * Must be called with meterDataMutex taken.
+ */
+long getBaseload( uint8_t IRQ_PIN_index)
+{
+  uint32_t baseload = BASELOAD_NONE;
+  for ( uint8_t hour = 0; hour < BASELOAD_HOURS; hour++)
+  {
+    if ( baseloadSlot[IRQ_PIN_index][hour] < baseload)
+      baseload = baseloadSlot[IRQ_PIN_index][hour];
+  }
+  return baseload == BASELOAD_NONE ? -1 : (long)baseload;
+}
+/*
+ * ###################################################################################################
+ *                       U P D A T E   F O R E C A S T
+ * ###################################################################################################
+ * When a new hour is reached, the pulses of the hour ended are learned in the profile for its hour of the day. The hour 
+ * is only learned, if it has been counted from its beginning to its end.
+ * Constant time. Must be called with meterDataMutex taken.
+ */
+void updateForecast( uint8_t IRQ_PIN_index, time_t now)
+{
+  uint32_t hour = now / 3600;
+  if ( hour == forecastHour[IRQ_PIN_index])
+    return;
+
+  if ( forecastHour[IRQ_PIN_index] == 0)
+    forecastFirstHour[IRQ_PIN_index] = hour;
+  else if ( hour == forecastHour[IRQ_PIN_index] + 1 && forecastHour[IRQ_PIN_index] != forecastFirstHour[IRQ_PIN_index])
+  {
+    time_t hourStart = (time_t)forecastHour[IRQ_PIN_index] * 3600;
+    struct tm timeinfo;
+    localtime_r( &hourStart, &timeinfo);
+
+    float * profile = &forecastProfile[IRQ_PIN_index][timeinfo.tm_hour];
+    if ( bitRead( forecastLearned[IRQ_PIN_index], timeinfo.tm_hour))
+      *profile += ( forecastHourPulses[IRQ_PIN_index] - *profile) * FORECAST_PROFILE_WEIGHT;
+    else
+    {
+      *profile = forecastHourPulses[IRQ_PIN_index];
+      bitSet( forecastLearned[IRQ_PIN_index], timeinfo.tm_hour);
+    }
+  }
+
+  forecastHour[IRQ_PIN_index] = hour;
+  forecastHourPulses[IRQ_PIN_index] = 0;
+}
+/*
+ * ###################################################################################################
+ *                       G E T   F O R E C A S T
+ * ###################################################################################################
+ * Calculate the energy (kWh) expected to be used by the end of the day and the end of the month (local time). 
+ * The pulses counted so far are added the learned profile for the rest of the hour, the rest of the day and the days
+ * left of the month. Hours not learned yet are expected at the average rate of today so far.
+ * Returns false until NTP time is set, or if pulses per kWh is not configured.
+ * Must be called with meterDataMutex taken.
+ */
+bool getForecast( uint8_t IRQ_PIN_index, time_t now, float * forecastDay, float * forecastMonth)
+{
+  if ( now < TIME_SET_EPOCH || interfaceConfig.pulse_per_kWh[IRQ_PIN_index] == 0)
+    return false;
+
+  struct tm timeinfo;
+  localtime_r( &now, &timeinfo);
+  data_t * data = &meterData[IRQ_PIN_index];
+
+  // The rate of today is taken over at least one demand window, to avoid extreme values just after midnight.
+  long secondsToday = timeinfo.tm_hour * 3600 + timeinfo.tm_min * 60 + timeinfo.tm_sec;
+  float hourRate = float(data->dayPulses) * 3600 / float( secondsToday > DEMAND_WINDOW ? secondsToday : DEMAND_WINDOW);
+
+  float hourPulses[24];
+  float dayPulses = 0;
+  for ( uint8_t hour = 0; hour < 24; hour++)
+  {
+    hourPulses[hour] = bitRead( forecastLearned[IRQ_PIN_index], hour) ? forecastProfile[IRQ_PIN_index][hour] : hourRate;
+    dayPulses += hourPulses[hour];
+  }
+
+  float restOfDay = hourPulses[timeinfo.tm_hour] * float(3600 - timeinfo.tm_min * 60 - timeinfo.tm_sec) / 3600;
+  for ( uint8_t hour = timeinfo.tm_hour + 1; hour < 24; hour++)
+    restOfDay += hourPulses[hour];
+
+  static const uint8_t daysInMonth[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+  int year = timeinfo.tm_year + 1900;
+  int daysLeft = daysInMonth[timeinfo.tm_mon] - timeinfo.tm_mday;
+  if ( timeinfo.tm_mon == 1 && year % 4 == 0 && ( year % 100 != 0 || year % 400 == 0))
+    daysLeft++;
+
+  *forecastDay = ( float(data->dayPulses) + restOfDay) / float(interfaceConfig.pulse_per_kWh[IRQ_PIN_index]);
+  *forecastMonth = ( float(data->monthPulses) + restOfDay + dayPulses * daysLeft) / float(interfaceConfig.pulse_per_kWh[IRQ_PIN_index]);
+  return true;
+}
+/*
+ * ###################################################################################################
+ *                       C H E C K   D E M A N D   P E R I O D
+ * ###################################################################################################
+ * Reset the maximum demand and the pulses of the day and month, when time (local time) is in another day or month 
+ * than the registers.
+ */
+void checkDemandPeriod( uint8_t IRQ_PIN_index, time_t time)
+{
+  struct tm timeinfo;
+  localtime_r( &time, &timeinfo);
+
+  uint32_t day = (uint32_t)timeinfo.tm_year * 366 + timeinfo.tm_yday;
+  uint32_t month = (uint32_t)timeinfo.tm_year * 12 + timeinfo.tm_mon;
+  if ( meterData[IRQ_PIN_index].demandDay != day)
+  {
+    meterData[IRQ_PIN_index].demandDay = day;
+    meterData[IRQ_PIN_index].demandMaxDay = 0;
+    meterData[IRQ_PIN_index].dayPulses = 0;
+  }
+  if ( meterData[IRQ_PIN_index].demandMonth != month)
+  {
+    meterData[IRQ_PIN_index].demandMonth = month;
+    meterData[IRQ_PIN_index].demandMaxMonth = 0;
+    meterData[IRQ_PIN_index].monthPulses = 0;
+  }
+}
+/*
+ * ###################################################################################################
+ *                       G E T   T A R I F F
+ * ###################################################################################################
+ * Returns the tariff at time, from the weekday and hour (local time) in private_tariffTable.
+ * Tariff 0 is used until NTP time is set.
+ * Constant time. localtime_r() is only called, when time is in another hour than the previous call.
+ * Must be called with meterDataMutex taken.
+ */
+uint8_t getTariff( time_t time)
+{
+  if ( time < TIME_SET_EPOCH)
+    return 0;
+  if ( time >= tariffHourStart && time < tariffHourEnd)
+    return tariffCurrent;
+
+  struct tm timeinfo;
+  localtime_r( &time, &timeinfo);
+
+  tariffCurrent = private_tariffTable[timeinfo.tm_wday][timeinfo.tm_hour];
+  if ( tariffCurrent >= PRIVATE_NO_OF_TARIFFS)
+    tariffCurrent = 0;
+  tariffHourStart = time - timeinfo.tm_min * 60 - timeinfo.tm_sec;
+  tariffHourEnd = tariffHourStart + 3600;
+  return tariffCurrent;
+}
+/*
+ * ###################################################################################################
+ *                       P U B L I S H   D I A G N O S T I C S   J S O N
+ * ###################################################################################################
+*/
+/*  Eksempel på Topic og Payload for diagnostics for channel 0
+Topic: energy/monitor_ESP32_48E72997D320/0/diagnostics
+Payload:
+{
+  "rejected" : 3,
+  "overflow" : 0,
+  "implausible" : 1,
+  "storms" : 0,
+  "fault" : "None",
+  "raw" : 12345,
+  "processed" : 12345,
+  "lost" : 0,
+  "dropped" : 0
+} 
+*/
+void publishDiagnosticsJson( uint8_t IRQ_PIN_index)
+{
+  uint8_t payload[512];
+  JsonDocument doc;
+
+  doc[MQTT_DIAG_REJECTED] = rejectedPulses[IRQ_PIN_index];
+  doc[MQTT_DIAG_OVERFLOW] = pulseRingOverflow[IRQ_PIN_index];
+  doc[MQTT_DIAG_IMPLAUSIBLE] = implausiblePulses[IRQ_PIN_index];
+  doc[MQTT_DIAG_STORMS] = stormCount[IRQ_PIN_index];
+  doc[MQTT_DIAG_RAW] = rawPulses[IRQ_PIN_index];
+  doc[MQTT_DIAG_PROCESSED] = processedPulses[IRQ_PIN_index];
+  doc[MQTT_DIAG_LOST] = getLostPulses( IRQ_PIN_index);
+  if ( PRIVATE_RECONCILE_LOST_PULSES)
+    doc[MQTT_DIAG_RECONCILED] = reconciledPulses[IRQ_PIN_index];
+  doc[MQTT_DIAG_DROPPED] = publishDropped[IRQ_PIN_index];
+  if ( bitRead(stormMaskedPins, IRQ_PIN_index))
+    doc[MQTT_DIAG_FAULT] = String("Interrupt storm. Masked for " + String(stormBackoff[IRQ_PIN_index]) + " seconds");
+  else
+    doc[MQTT_DIAG_FAULT] = "None";
+
+  size_t length = serializeJson(doc, payload);
+  String diagnosticsTopic = String(MQTT_PREFIX + mqttDeviceNameWithMac + "/" + IRQ_PIN_index + MQTT_SUFFIX_DIAGNOSTICS);
+
+  mqttClient.publish(diagnosticsTopic.c_str(), payload, length, RETAINED);
+}
+/*
+ * ###################################################################################################
+ *                       P U B L I S H   L A T E N C Y   J S O N
+ * ###################################################################################################
+*/
+/*  Eksempel på Topic og Payload for latency histograms for channel 0
+Topic: energy/monitor_ESP32_48E72997D320/0/latency
+Payload:
+{
+  "publish" : [0,0,0,0,0,0,0,0,0,0,0,3,41,17,2],
+  "sd" : [0,0,0,0,0,0,0,0,0,0,0,0,0,52,11]
+} 
+Element k is the number of pulses with a latency of 2^k .. 2^(k+1) - 1 microseconds. Trailing empty bins are left out.
+*/
+void publishLatencyJson( uint8_t IRQ_PIN_index)
+{
+  int8_t lastBin = -1;
+  for ( uint8_t bin = 0; bin < LATENCY_BINS; bin++)
+  {
+    if ( publishLatency[IRQ_PIN_index][bin] > 0 || sdLatency[IRQ_PIN_index][bin] > 0)
+      lastBin = bin;
+  }
+  if ( lastBin < 0)           // No pulses yet
+    return;
+
+  uint8_t payload[1024];
+  JsonDocument doc;
+
+  JsonArray publishArray = doc[MQTT_LATENCY_PUBLISH].to<JsonArray>();
+  JsonArray sdArray = doc[MQTT_LATENCY_SD].to<JsonArray>();
+  for ( uint8_t bin = 0; bin <= lastBin; bin++)
+  {
+    publishArray.add( publishLatency[IRQ_PIN_index][bin]);
+    sdArray.add( sdLatency[IRQ_PIN_index][bin]);
+  }
+
+  size_t length = serializeJson(doc, payload);
+  String latencyTopic = String(MQTT_PREFIX + mqttDeviceNameWithMac + "/" + IRQ_PIN_index + MQTT_SUFFIX_LATENCY);
+
+  mqttClient.publish(latencyTopic.c_str(), payload, length, RETAINED);
+}
+/*
+ * ###################################################################################################
+ *                       P U B L I S H   L O A D   D U R A T I O N   J S O N
+ * ###################################################################################################
+*/
+/*  Eksempel på Topic og Payload for the load duration histogram for channel 0
+Topic: energy/monitor_ESP32_48E72997D320/0/load_duration
+Payload:
+{
+  "seconds" : [21480,0,0,0,0,0,0,0,0,0,0,0,0,0,0,3120,18230,25410,9830,4120,2310,1250,470,180]
+} 
+Element k is the number of seconds within the subtotal period with a consumption in bin k. Bin 0 is 0 W, bin 1 is 1 W,
+bin 2k starts at 2^k W and bin 2k + 1 at 1.5 * 2^k W. Trailing empty bins are left out.
+*/
+void publishLoadDurationJson( uint8_t IRQ_PIN_index, const int64_t * histogram)
+{
+  int8_t lastBin = -1;
+  for ( uint8_t bin = 0; bin < LOAD_DURATION_BINS; bin++)
+  {
+    if ( histogram[bin] > 0)
+      lastBin = bin;
+  }
+  if ( lastBin < 0)           // No pulses yet
+    return;
+
+  uint8_t payload[512];
+  JsonDocument doc;
+
+  JsonArray secondsArray = doc[MQTT_LOAD_DURATION_SECONDS].to<JsonArray>();
+  for ( uint8_t bin = 0; bin <= lastBin; bin++)
+    secondsArray.add( (uint32_t)(( histogram[bin] + 500000) / 1000000));
+
+  size_t length = serializeJson(doc, payload);
+  String loadDurationTopic = String(MQTT_PREFIX + mqttDeviceNameWithMac + "/" + IRQ_PIN_index + MQTT_SUFFIX_LOAD_DURATION);
+
+  mqttClient.publish(loadDurationTopic.c_str(), payload, length, RETAINED);
+}
+/*
+ * ###################################################################################################
+ *                       P U B L I S H   M I N U T E   J S O N
+ * ###################################################################################################
+*/
+/*  Eksempel på Topic og Payload for the minute aggregate for channel 0
+Topic: energy/monitor_ESP32_48E72997D320/0/minute
+Payload:
+{
+  "time" : 1718000040,
+  "Wh" : 12.5,
+  "min" : 690,
+  "avg" : 750,
+  "max" : 820,
+  "pulses" : 125
+}
+"time" is the beginning of the minute (seconds since epoch). The minute before NTP time is set is shorter or longer.
+*/
+void publishMinuteJson( uint8_t IRQ_PIN_index, const minuteAggregate_t * minute, int64_t minuteLength)
+{
+  uint8_t payload[256];
+  JsonDocument doc;
+
+  long averageWatt = minuteAggregateAverageWatt( minute, interfaceConfig.pulse_per_kWh[IRQ_PIN_index], minuteLength);
+
+  doc[MQTT_MINUTE_TIME] = aggregateMinute * 60;
+  doc[MQTT_MINUTE_ENERGY] = float(minuteAggregateMilliWh( minute, interfaceConfig.pulse_per_kWh[IRQ_PIN_index])) / 1000.0;
+  doc[MQTT_MINUTE_MIN] = minuteAggregateMinWatt( minute, averageWatt);
+  doc[MQTT_MINUTE_AVERAGE] = averageWatt;
+  doc[MQTT_MINUTE_MAX] = minuteAggregateMaxWatt( minute, averageWatt);
+  doc[MQTT_MINUTE_PULSES] = minute->pulses;
+
+  size_t length = serializeJson(doc, payload);
+  String minuteTopic = String(MQTT_PREFIX + mqttDeviceNameWithMac + "/" + IRQ_PIN_index + MQTT_SUFFIX_MINUTE);
+
+  mqttClient.publish(minuteTopic.c_str(), payload, length, UNRETAINED);
+}
+/*
+ * ###################################################################################################
+ *                       P U B L I S H   S T E P   J S O N
+ * ###################################################################################################
+*/
+/*  Eksempel på Topic og Payload for a step detected on channel 5
+Topic: energy/monitor_ESP32_48E72997D320/5/step
+Payload:
+{
+  "step" : 850,
+  "from" : 150,
+  "to" : 1000,
+  "time" : 1718000047
+}
+"step" is positive when an appliance switches on, and negative when it switches off.
+*/
+void publishStepJson( const stepEvent_t * stepEvent)
+{
+  uint8_t payload[128];
+  JsonDocument doc;
+
+  doc[MQTT_STEP_STEP] = stepEvent->wattAfter - stepEvent->wattBefore;
+  doc[MQTT_STEP_FROM] = stepEvent->wattBefore;
+  doc[MQTT_STEP_TO] = stepEvent->wattAfter;
+  doc[MQTT_STEP_TIME] = stepEvent->time;
+
+  size_t length = serializeJson(doc, payload);
+  String stepTopic = String(MQTT_PREFIX + mqttDeviceNameWithMac + "/" + stepEvent->IRQ_PIN_index + MQTT_SUFFIX_STEP);
+
+  mqttClient.publish(stepTopic.c_str(), payload, length, UNRETAINED);
+}
+/*
+ * ###################################################################################################
+ *                       R E C O R D   L A T E N C Y
+ * ###################################################################################################
+ * Count a latency (microseconds) in a log2 histogram with LATENCY_BINS bins. The last bin counts everything above.
+*/
+void recordLatency( uint32_t * histogram, int64_t latency)
+{
+  uint8_t bin = 0;
+  if ( latency > 1)
+    bin = 63 - __builtin_clzll( (uint64_t)latency);
+  if ( bin >= LATENCY_BINS)
+    bin = LATENCY_BINS - 1;
+  histogram[bin]++;
+}
+/*
+ * ###################################################################################################
+ *                       R E C O R D   L O A D   D U R A T I O N
+ * ###################################################################################################
+ * Count the time since loadDurationAt[] up till timeStamp in the load duration bin of a consumption (W).
+ * Bin 0 is 0 W and bin 1 is 1 W. From bin 2 each bin is half an octave: Bin 2k starts at 2^k W and bin 2k + 1 at
+ * 1.5 * 2^k W. The last bin counts everything from 49152 W. Nothing is counted before the first timestamp, or for a 
+ * timestamp before the time already counted (e.g. a pulse processed after the histogram was published).
+ * Must be called with meterDataMutex taken.
+*/
+void recordLoadDuration( uint8_t IRQ_PIN_index, long watt, int64_t timeStamp)
+{
+  if ( timeStamp <= loadDurationAt[IRQ_PIN_index])
+    return;
+
+  if ( loadDurationAt[IRQ_PIN_index] > 0)
+  {
+    uint8_t bin = 0;
+    if ( watt == 1)
+      bin = 1;
+    else if ( watt > 1)
+    {
+      uint8_t msb = 31 - __builtin_clz( (uint32_t)watt);
+      bin = 2 * msb + (( watt >> (msb - 1)) & 1);
+    }
+    if ( bin >= LOAD_DURATION_BINS)
+      bin = LOAD_DURATION_BINS - 1;
+    loadDuration[IRQ_PIN_index][bin] += timeStamp - loadDurationAt[IRQ_PIN_index];
+  }
+  loadDurationAt[IRQ_PIN_index] = timeStamp;
+}
+/*
+ * ###################################################################################################
+ *                       P U B L I S H   L O A D   D U R A T I O N S
+ * ###################################################################################################
+ * Publish the load duration histograms and reset them for the next subtotal period. The time since the latest pulse or
+ * estimate is counted at the consumption published latest, so the histograms cover the whole period.
+*/
+void publishLoadDurations()
+{
+  int64_t timeStamp = esp_timer_get_time();
+  for ( uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
+  {
+    int64_t histogram[LOAD_DURATION_BINS];
+
+    xSemaphoreTake( meterDataMutex, portMAX_DELAY);
+    recordLoadDuration( ii, metaData[ii].decayWatt, timeStamp);
+    for ( uint8_t bin = 0; bin < LOAD_DURATION_BINS; bin++)
+    {
+      histogram[bin] = loadDuration[ii][bin];
+      loadDuration[ii][bin] = 0;
+    }
+    xSemaphoreGive( meterDataMutex);
+
+    if ( esp32Connected)
+      publishLoadDurationJson( ii, histogram);
+  }
+}
+/*
+ * ###################################################################################################
+ *                       G E T   L O S T   P U L S E S
+ * ###################################################################################################
+ * Returns the number of pulses accepted by the capture layer, which never made it to meterData[].
+ * The counters and the ring buffer are read within a critical section, so a pulse arriving or being processed meanwhile
+ * is not counted as lost.
+*/
+unsigned long getLostPulses( uint8_t IRQ_PIN_index)
+{
+  portENTER_CRITICAL(&pulseRingMux);
+  unsigned long raw = rawPulses[IRQ_PIN_index];
+  unsigned long processed = processedPulses[IRQ_PIN_index];
+  uint16_t pending = pulseRingHead[IRQ_PIN_index] - pulseRingTail[IRQ_PIN_index];
+  portEXIT_CRITICAL(&pulseRingMux);
+
+  return raw - processed - pending;
+}
+/*
+ * ###################################################################################################
+ *                       M Q T T   C A L L B A C K  
+ * ###################################################################################################
+ */;/*
+ * For more information about MQTT, visit: https://mqtt.org/
+ * For more information about pubsubclient, mqttCallback, visit:
+ * - https://pubsubclient.knolleary.net/
+ * - https://pubsubclient.knolleary.net/api
+ * - https://arduinojson.org
+ * The function gets a IRQ pin reference number from the topic and
+ * handles messages with the folowing suffixes:
+ */
+void mqttCallback(char* topic, byte* payload, unsigned int length)
+{
+  JsonDocument doc;                         // 
+  byte IRQ_PIN_reference = 0;
+  String topicString = String(topic);
+
+  if( topicString.startsWith(MQTT_PREFIX))
+  {
+    IRQ_PIN_reference = getIRQ_PIN_reference(topic);
+  }
+
+  if ( topicString.endsWith(MQTT_SUFFIX_TOTAL_TRESHOLD))
+  {
+    // Only the threshold topic holds an energy meter number. Device topics are parsed to arbitrary numbers.
+    if ( IRQ_PIN_reference >= PRIVATE_NO_OF_CHANNELS)
+      return;
+    deserializeJson(doc, payload, length);
+    xSemaphoreTake( meterDataMutex, portMAX_DELAY);
+    meterData[IRQ_PIN_reference].pulseTotal = long(float(doc[MQTT_NUMBER_ENERG_ENTITYNAME]) * float(interfaceConfig.pulse_per_kWh[IRQ_PIN_reference]));
+    xSemaphoreGive( meterDataMutex);
+    long watt_consumption = 0;
+    publishSensorJson( watt_consumption, IRQ_PIN_reference, false);
+  }
+  else if ( topicString.endsWith(MQTT_SUFFIX_CONFIG))
+  {
+    /* Set pulse time correction in milliseconds. Done by:
+    * Publish: {"pulscorr" : 25}
+    * To topic: energy/monitor_ESP32_48E72997D320/config
+    * 
+    * Set the number of pulse intervals the consumption is averaged over (1 .. POWER_WINDOW_MAX). Done by:
+    * Publish: {"window" : 8}                      for all channels, or
+    * Publish: {"window" : [8, 8, 1, 1, 4, 4, 4, 4]} for each channel
+    * To topic: energy/monitor_ESP32_48E72997D320/config
+    */
   
     deserializeJson(doc, payload, length);
+    xSemaphoreTake( meterDataMutex, portMAX_DELAY);
     if ( doc.containsKey( MQTT_PULSTIME_CORRECTION))
     {
       interfaceConfig.pulseTimeCorrection = long(doc[MQTT_PULSTIME_CORRECTION]);
     }
+    if ( doc[MQTT_POWER_WINDOW].is<JsonArray>())
+    {
+      JsonArray windows = doc[MQTT_POWER_WINDOW].as<JsonArray>();
+      for ( uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS && ii < windows.size(); ii++)
+        interfaceConfig.powerWindow[ii] = constrain( int(windows[ii]), 1, POWER_WINDOW_MAX);
+    }
+    else if ( doc.containsKey( MQTT_POWER_WINDOW))
+    {
+      for ( uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
+        interfaceConfig.powerWindow[ii] = constrain( int(doc[MQTT_POWER_WINDOW]), 1, POWER_WINDOW_MAX);
+    }
+    setConsumptionEngines();
     writeConfigData();
+    xSemaphoreGive( meterDataMutex);
   }
   else if ( topicString.endsWith(MQTT_SUFFIX_SUBTOTAL_RESET))
   {
@@ -1426,75 +2917,607 @@ void mqttCallback(char* topic, byte* payload, unsigned int length)
     
     if (PRIVATE_UPDATE_GOOGLE_SHEET)
       updateGoogleSheets( 0);
+    publishLoadDurations();
+    xSemaphoreTake( meterDataMutex, portMAX_DELAY);
     for ( uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
     {
       meterData[ii].pulseSubTotal = 0;
       if ( !SD_Failed ) 
         writeMeterData( ii);
     }
+    xSemaphoreGive( meterDataMutex);
     
   }
   else if ( topicString.endsWith(MQTT_SUFFIX_STATUS))
   {
-    for (uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
+    for (uint8_t ii = 0; ii < NO_OF_METERS; ii++)
     {
       configurationPublished[ii] = false;
     } 
+    configurationsPending = true;
   }
 }
 /*
  * ###################################################################################################
- *                   S T O R E   I R Q    P I N  
+ *                       P U L S E   T A S K
  * ###################################################################################################
- */;/*
- *  ISR handler function
- *  The function wil receive a reference to i specific BIT in the 8 bit variable 'IRQ_PINs_stored'
- *  and set the BIT using the  bitSet() function.
+ * Runs on PULSE_TASK_CORE, while loop() runs on the other core.
+ * The task sleeps until notified by an ISR, or until the earliest deadline in channelDeadlines. With CAPTURE_PCNT it 
+ * sleeps at most PULSE_TASK_PERIOD, which is the interval of the PCNT poll.
+ */
+void pulseTask( void * parameter)
+{
+  for (;;)
+  {
+    int64_t waitMs = PULSE_TASK_MAX_WAIT;
+    int64_t nextDeadline = deadlineQueueNext( &channelDeadlines);
+    if ( nextDeadline > 0)
+    {
+      // Round up, so the task does not wake up just before the deadline.
+      int64_t remainingMs = ( nextDeadline - esp_timer_get_time() + 999) / 1000;
+      waitMs = constrain( remainingMs, 0, PULSE_TASK_MAX_WAIT);
+    }
+#if PRIVATE_CAPTURE_BACKEND == CAPTURE_PCNT
+    if ( waitMs > PULSE_TASK_PERIOD)
+      waitMs = PULSE_TASK_PERIOD;
+#endif
+    ulTaskNotifyTake( pdTRUE, pdMS_TO_TICKS( waitMs));
+
+#if PRIVATE_CAPTURE_BACKEND == CAPTURE_PCNT
+    // >>>>>>>>>>>>>>>>>>>>   Collect pulses counted by the PCNT peripheral   <<<<<<<<<<<<<<<<<<<<<<<<<<
+    pollPulseCounters();
+#endif
+
+    if ( IRQ_PINs_stored > 0)          // If IRQ has occoured IRQ_PINs_store will be > 0.
+      processPulses();
+
+    checkDeadlines();
+  }
+}
+
+/*
+ * ###################################################################################################
+ *                       P R O C E S S   P U L S E S
+ * ###################################################################################################
+ * Drain the ring buffers for the channels with pulses, calculate the power consumption and update meterData[].
+ * Every timestamp in the ring buffer is a pulse. Count them all, but write to SD and publish only once per channel, 
+ * using the consumption calculated from the latest pulse.
+ * Channels in count mode are written to SD and published by checkCountWindow() instead.
+ */
+void processPulses()
+{
+  // Take a copy of IRQ_PINs_stored and clear it. Pulses registered while the ring buffers are drained will set the bits again.
+  portENTER_CRITICAL(&pulseRingMux);
+  uint32_t pendingPins = IRQ_PINs_stored;
+  IRQ_PINs_stored = 0;
+  portEXIT_CRITICAL(&pulseRingMux);
+
+  // Iterate through the bits set in pendingPins only. Cost does not grow with the number of channels.
+  while ( pendingPins)
+  {
+    uint8_t IRQ_PIN_index = __builtin_ctz(pendingPins);   // Index of the least significant bit set
+    pendingPins &= pendingPins - 1;                        // Clear the least significant bit set
+
+    long watt_consumption = 0;
+    int64_t storedAt = pulseStoredAt[IRQ_PIN_index];      // Read before draining, so the pulse is among the drained ones.
+
+    // Wall clock time for the pulse timestamps, which are microseconds since boot.
+    time_t epochNow = time(nullptr);
+    int64_t timeNow = esp_timer_get_time();
+
+    xSemaphoreTake( meterDataMutex, portMAX_DELAY);
+    updateDemand( IRQ_PIN_index, epochNow);
+    while ( pulseRingTail[IRQ_PIN_index] != pulseRingHead[IRQ_PIN_index])
+    {
+      int64_t pulseTime = pulseRing[IRQ_PIN_index][pulseRingTail[IRQ_PIN_index] & (PULSE_RING_SIZE - 1)];
+      portENTER_CRITICAL(&pulseRingMux);
+      pulseRingTail[IRQ_PIN_index]++;                    // Release the slot to the ISR
+      processedPulses[IRQ_PIN_index]++;                  // Counted in meterData[] below, while meterDataMutex is taken.
+      portEXIT_CRITICAL(&pulseRingMux);
+
+      //   >>>>>>>>>>>>>>>>>>>>>>>>>>>  Calculate power comsumption   <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+      /*
+        * It does not make sence to calculate consumption when the privious pulse is unkown (0).
+        * Timestamps are 64 bit microseconds, which will not overflow.
+        */
+      watt_consumption = 0;
+      if ( countMode[IRQ_PIN_index])
+      {
+        countWindowPulses[IRQ_PIN_index]++;
+      }
+      else if ( metaData[IRQ_PIN_index].pulseTimeStamp > 0 && metaData[IRQ_PIN_index].pulseTimeStamp < pulseTime)
+      { 
+        int64_t interval = pulseTime - metaData[IRQ_PIN_index].pulseTimeStamp;
+        long intervalWatt = consumptionWatt( &consumptionEngine[IRQ_PIN_index], interval);
+        minuteAggregateAddPower( &minuteAggregate[IRQ_PIN_index], intervalWatt);
+        recordLoadDuration( IRQ_PIN_index, intervalWatt, pulseTime);
+        if ( PRIVATE_STEP_DETECTION && private_step_min_W[IRQ_PIN_index] > 0)
+          detectStep( IRQ_PIN_index, interval, epochNow - (timeNow - pulseTime) / 1000000);
+        powerWindowAdd( &powerWindow[IRQ_PIN_index], interval);
+        watt_consumption = powerWindowWatt( &consumptionEngine[IRQ_PIN_index], &powerWindow[IRQ_PIN_index]);
+
+        // Switch to count mode at high pulse rates. The window starts at this pulse.
+        if ( PRIVATE_COUNT_MODE_RATE > 0 && interval * PRIVATE_COUNT_MODE_RATE < 1000000)
+        {
+          countMode[IRQ_PIN_index] = true;
+          countWindowStart[IRQ_PIN_index] = pulseTime;
+          countWindowReference[IRQ_PIN_index] = pulseTime;
+          countWindowPulses[IRQ_PIN_index] = 0;
+        }
+      }
+
+      //   >>>>>>>>>>>>>>>>>>>>>>>>>>>  Update meterData   <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+      metaData[IRQ_PIN_index].pulseTimeStamp = pulseTime;
+      meterData[IRQ_PIN_index].pulseTotal++;
+      meterData[IRQ_PIN_index].pulseSubTotal++;
+      minuteAggregateAddPulse( &minuteAggregate[IRQ_PIN_index]);
+      meterData[IRQ_PIN_index].demandPulses++;
+      meterData[IRQ_PIN_index].dayPulses++;
+      meterData[IRQ_PIN_index].monthPulses++;
+      forecastHourPulses[IRQ_PIN_index]++;
+      meterData[IRQ_PIN_index].tariffPulses[getTariff( epochNow - (timeNow - pulseTime) / 1000000)]++;
+    }
+
+    if ( countMode[IRQ_PIN_index])
+    {
+      setChannelDeadline( IRQ_PIN_index);
+      xSemaphoreGive( meterDataMutex);
+      continue;
+    }
+
+    metaData[IRQ_PIN_index].decayWatt = watt_consumption;
+    scheduleDecay( IRQ_PIN_index);
+    setChannelDeadline( IRQ_PIN_index);
+
+    //   >>>>>>>>>>>>>>>>>>>>>>>>>>>  Store meterData and queue totals for publishing   <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+    if ( !SD_Failed )
+    {
+      writeMeterData( IRQ_PIN_index);
+      recordLatency( sdLatency[IRQ_PIN_index], esp_timer_get_time() - storedAt);
+    }
+    xSemaphoreGive( meterDataMutex);
+
+    queuePublishEvent( IRQ_PIN_index, watt_consumption, true, storedAt);
+  }
+}
+
+/*
+ * ###################################################################################################
+ *                       C H E C K   D E A D L I N E S
+ * ###################################################################################################
+ * Handle the channels with a deadline passed in channelDeadlines. Each channel is removed from the queue, and a new
+ * deadline is set by the handler, if required.
+ */
+void checkDeadlines()
+{
+  int64_t timeStamp = esp_timer_get_time();
+  uint8_t ii;
+
+  while ( deadlineQueuePop( &channelDeadlines, timeStamp, &ii))
+  {
+    if ( countMode[ii])
+      checkCountWindow( ii, timeStamp);
+    else
+      checkPulseTime( ii, timeStamp);
+  }
+}
+
+/*
+ * ###################################################################################################
+ *                       S E T   C H A N N E L   D E A D L I N E
+ * ###################################################################################################
+ * Set the deadline in channelDeadlines for a channel: The end of the count window in count mode, otherwise the next
+ * estimated consumption. Must be called, whenever one of them has been changed.
+ */
+void setChannelDeadline( uint8_t IRQ_PIN_index)
+{
+  if ( countMode[IRQ_PIN_index])
+    deadlineQueueSet( &channelDeadlines, IRQ_PIN_index, countWindowStart[IRQ_PIN_index] + COUNT_MODE_WINDOW);
+  else
+    deadlineQueueSet( &channelDeadlines, IRQ_PIN_index, metaData[IRQ_PIN_index].decayAt);
+}
+
+/*
+ * ###################################################################################################
+ *                       C H E C K   C O U N T   W I N D O W
+ * ###################################################################################################
+ * At the end of a window for a channel in count mode, calculate the consumption from the pulses counted in the window,
+ * write meterData[] to SD and queue the consumption for publishing.
+ * If the rate has dropped below PRIVATE_COUNT_MODE_RATE / COUNT_MODE_HYSTERESIS, the channel goes back to a consumption
+ * per pulse interval. Otherwise the next window starts.
+ * Called by checkDeadlines(), when the window has ended.
+ */
+void checkCountWindow( uint8_t ii, int64_t timeStamp)
+{
+  // Without pulses in the window there is nothing to store, and the pulse time check takes over the consumption.
+  if ( countWindowPulses[ii] > 0)
+  {
+    int64_t storedAt = pulseStoredAt[ii];
+
+    xSemaphoreTake( meterDataMutex, portMAX_DELAY);
+    long watt_consumption = (consumptionMilliWattAverage( &consumptionEngine[ii], 
+                                                          metaData[ii].pulseTimeStamp - countWindowReference[ii],
+                                                          countWindowPulses[ii]) + 500) / 1000;
+    metaData[ii].decayWatt = watt_consumption;
+    scheduleDecay( ii);
+    minuteAggregateAddPower( &minuteAggregate[ii], watt_consumption);
+    recordLoadDuration( ii, watt_consumption, timeStamp);
+    if ( !SD_Failed )
+    {
+      writeMeterData( ii);
+      recordLatency( sdLatency[ii], esp_timer_get_time() - storedAt);
+    }
+    xSemaphoreGive( meterDataMutex);
+
+    queuePublishEvent( ii, watt_consumption, true, storedAt);
+  }
+
+  if ( (int64_t)countWindowPulses[ii] * COUNT_MODE_HYSTERESIS * 1000000 < (int64_t)PRIVATE_COUNT_MODE_RATE * COUNT_MODE_WINDOW)
+  {
+    // Back to a consumption per pulse interval. Intervals from before count mode must not be averaged with the following.
+    countMode[ii] = false;
+    xSemaphoreTake( meterDataMutex, portMAX_DELAY);
+    powerWindowInit( &powerWindow[ii], powerWindow[ii].length);
+    xSemaphoreGive( meterDataMutex);
+    stepDetectorInit( &stepDetector[ii], STEP_MIN_PERCENT, STEP_THRESHOLD_FACTOR);
+  }
+  else
+  {
+    countWindowStart[ii] = timeStamp;
+    countWindowReference[ii] = metaData[ii].pulseTimeStamp;
+    countWindowPulses[ii] = 0;
+  }
+  setChannelDeadline( ii);
+}
+
+/*
+ * ###################################################################################################
+ *                       C H E C K   P U L S E   T I M E
+ * ###################################################################################################
+ * Publish an estimated consumption, when pulses have stopped arriving.
  * 
- * Because the function is part of the ISR functionality it is defined as IRAM_ATTR
-*/
-void IRAM_ATTR store_IRQ_PIN(u_int8_t BIT_Reference)
+ * As the next pulse has not arrived yet, less than one pulse of energy has been used since the latest pulse. The 
+ * consumption is therefore at most one pulse divided by the time since the latest pulse, and this upper bound keeps
+ * dropping as long as no pulse arrives. It is published with "Estimated" set to true, and never higher than the value 
+ * published before. When it becomes less than MIN_CONSUMPTION, 0 is published and no further estimates are made.
+ * When to publish is scheduled by scheduleDecay(), and checkDeadlines() calls this when the time has come.
+ */
+void checkPulseTime( uint8_t ii, int64_t timeStamp)
 {
-  millsTimeStamp[BIT_Reference] = millis();
-  bitSet(IRQ_PINs_stored, BIT_Reference);
+  // The consumption engines are changed by mqttCallback() on the other core.
+  xSemaphoreTake( meterDataMutex, portMAX_DELAY);
+  long watt_consumption = consumptionWatt( &consumptionEngine[ii], timeStamp - metaData[ii].pulseTimeStamp);
+  if ( watt_consumption > metaData[ii].decayWatt)
+    watt_consumption = metaData[ii].decayWatt;
+  if ( watt_consumption < MIN_CONSUMPTION)
+    watt_consumption = 0;
+
+  metaData[ii].decayWatt = watt_consumption;
+  scheduleDecay( ii);
+  setChannelDeadline( ii);
+  minuteAggregateAddPower( &minuteAggregate[ii], watt_consumption);
+  recordLoadDuration( ii, watt_consumption, timeStamp);
+
+  // The consumption has dropped. Intervals from before the drop must not be averaged with the following.
+  powerWindowInit( &powerWindow[ii], powerWindow[ii].length);
+  xSemaphoreGive( meterDataMutex);
+
+  queuePublishEvent( ii, watt_consumption, false, 0);
 }
 
 /*
  * ###################################################################################################
- *                  I S R    Functions
+ *                       S C H E D U L E   D E C A Y
  * ###################################################################################################
-*/;/*
- *  IRS - Define an ISR for each Interrupt channel, which call the common interrupt handler function.
-*/
-void IRAM_ATTR Ext_INT1_ISR()
+ * Calculate when the upper bound of the consumption will have dropped to DECAY_RATIO percent of metaData[].decayWatt,
+ * or to MIN_CONSUMPTION if that is higher. No more estimates are scheduled after 0 has been published.
+ * Must be called with meterDataMutex taken.
+ */
+void scheduleDecay( uint8_t IRQ_PIN_index)
+{
+  int64_t milliWatt = (int64_t)metaData[IRQ_PIN_index].decayWatt * DECAY_RATIO * 10;
+  if ( milliWatt < MIN_CONSUMPTION * 1000)
+    milliWatt = MIN_CONSUMPTION * 1000 - 1;         // Publish 0, when the consumption becomes less than MIN_CONSUMPTION
+
+  int64_t interval = consumptionInterval( &consumptionEngine[IRQ_PIN_index], milliWatt);
+  if ( metaData[IRQ_PIN_index].decayWatt == 0 || metaData[IRQ_PIN_index].pulseTimeStamp == 0 || interval <= 0)
+    metaData[IRQ_PIN_index].decayAt = 0;
+  else
+    metaData[IRQ_PIN_index].decayAt = metaData[IRQ_PIN_index].pulseTimeStamp + interval;
+}
+
+/*
+ * ###################################################################################################
+ *                       Q U E U E   P U B L I S H   E V E N T
+ * ###################################################################################################
+ * Pass a consumption to loop() for publishing. The pulse task never waits for loop(). If the queue is full the 
+ * event is dropped and counted in publishDropped[]. The totals are still counted, and published with the next event.
+ */
+void queuePublishEvent( uint8_t IRQ_PIN_index, long watt_consumption, bool pulse, int64_t storedAt)
+{
+  publishEvent_t publishEvent = { IRQ_PIN_index, watt_consumption, pulse, storedAt };
+  if ( xQueueSend( publishQueue, &publishEvent, 0) != pdTRUE)
+    publishDropped[IRQ_PIN_index]++;
+}
+
+/*
+ * ###################################################################################################
+ *                       D E T E C T   S T E P
+ * ###################################################################################################
+ * Feed a pulse interval to the step detector of the channel. Steps of at least private_step_min_W[] are passed to
+ * loop() for publishing. Smaller steps (e.g. at low consumption) are ignored.
+ * Called by the pulse task with meterDataMutex taken, as the consumption engine is used.
+ */
+void detectStep( uint8_t IRQ_PIN_index, int64_t interval, time_t pulseTime)
 {
-  store_IRQ_PIN( 0);
+  int64_t intervalBefore, intervalAfter;
+  if ( stepDetectorUpdate( &stepDetector[IRQ_PIN_index], interval, &intervalBefore, &intervalAfter) == STEP_NONE)
+    return;
+
+  stepEvent_t stepEvent = { IRQ_PIN_index,
+                            consumptionWatt( &consumptionEngine[IRQ_PIN_index], intervalBefore),
+                            consumptionWatt( &consumptionEngine[IRQ_PIN_index], intervalAfter),
+                            pulseTime };
+  if ( labs( stepEvent.wattAfter - stepEvent.wattBefore) < private_step_min_W[IRQ_PIN_index])
+    return;
+
+  if ( xQueueSend( stepQueue, &stepEvent, 0) != pdTRUE)
+    publishDropped[IRQ_PIN_index]++;
 }
-void IRAM_ATTR Ext_INT2_ISR()
+
+/*
+ * ###################################################################################################
+ *                   I N I T   P U L S E   C O U N T E R S
+ * ###################################################################################################
+ * Used when PRIVATE_CAPTURE_BACKEND is CAPTURE_PCNT.
+ * Configure a PCNT unit for each channel to count rising edges, the same edges as the ISR's are triggered by.
+ * The glitch filter ignores pulses shorter than PCNT_FILTER_VALUE APB clock cycles.
+ */
+void initPulseCounters()
 {
-  store_IRQ_PIN( 1);
+  for ( uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS && ii < PCNT_UNIT_MAX; ii++)
+  {
+    pcnt_config_t pcntConfig = {};
+    pcntConfig.pulse_gpio_num = channelPin[ii];
+    pcntConfig.ctrl_gpio_num = PCNT_PIN_NOT_USED;
+    pcntConfig.lctrl_mode = PCNT_MODE_KEEP;
+    pcntConfig.hctrl_mode = PCNT_MODE_KEEP;
+    pcntConfig.pos_mode = PCNT_COUNT_INC;           // Count rising edges
+    pcntConfig.neg_mode = PCNT_COUNT_DIS;
+    pcntConfig.counter_h_lim = PCNT_HIGH_LIMIT;
+    pcntConfig.counter_l_lim = 0;
+    pcntConfig.unit = (pcnt_unit_t)ii;
+    pcntConfig.channel = PCNT_CHANNEL_0;
+    pcnt_unit_config(&pcntConfig);
+
+    pcnt_set_filter_value((pcnt_unit_t)ii, PCNT_FILTER_VALUE);
+    pcnt_filter_enable((pcnt_unit_t)ii);
+
+    pcnt_counter_pause((pcnt_unit_t)ii);
+    pcnt_counter_clear((pcnt_unit_t)ii);
+    pcnt_counter_resume((pcnt_unit_t)ii);
+
+    pcntCounted[ii] = 0;
+    pcntPolledAt[ii] = esp_timer_get_time();
+  }
 }
-void IRAM_ATTR Ext_INT3_ISR()
+
+/*
+ * ###################################################################################################
+ *                   P O L L   P U L S E   C O U N T E R S
+ * ###################################################################################################
+ * Used when PRIVATE_CAPTURE_BACKEND is CAPTURE_PCNT.
+ * Transfer pulses counted by the PCNT units since last poll to the ring buffers, which are then handled
+ * exactly as pulses registered by the ISR.
+ * The exact time of each pulse is unknown. If more than one pulse has been counted since last poll, the pulses are 
+ * spread evenly over the time since last poll.
+ * Pulses, which do not fit into the ring buffer, are left in the counter until next poll. Thereby no pulses are lost.
+ */
+void pollPulseCounters()
 {
-  store_IRQ_PIN( 2);
+  int64_t timeStamp = esp_timer_get_time();
+
+  for ( uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS && ii < PCNT_UNIT_MAX; ii++)
+  {
+    int16_t counter = 0;
+    pcnt_get_counter_value((pcnt_unit_t)ii, &counter);
+
+    uint16_t newPulses = (counter - pcntCounted[ii] + PCNT_HIGH_LIMIT) % PCNT_HIGH_LIMIT;
+    uint16_t freeSlots = PULSE_RING_SIZE - (uint16_t)(pulseRingHead[ii] - pulseRingTail[ii]);
+    uint16_t transfer = newPulses < freeSlots ? newPulses : freeSlots;
+
+    int64_t pulseTime = pcntPolledAt[ii];
+    for ( uint16_t jj = 1; jj <= transfer; jj++)
+    {
+      pulseTime = pcntPolledAt[ii] + (timeStamp - pcntPolledAt[ii]) * jj / newPulses;
+      store_IRQ_PIN( ii, pulseTime);
+    }
+    if ( newPulses == 0)
+      pulseTime = timeStamp;
+
+    pcntCounted[ii] = (pcntCounted[ii] + transfer) % PCNT_HIGH_LIMIT;
+    pcntPolledAt[ii] = pulseTime;
+  }
 }
-void IRAM_ATTR Ext_INT4_ISR()
+
+/*
+ * ###################################################################################################
+ *                   I N I T   P U L S E   S A M P L E R
+ * ###################################################################################################
+ * Used when PRIVATE_CAPTURE_BACKEND is CAPTURE_SAMPLER.
+ * Initialize a debounce state machine for each channel, and start a hardware timer, which will call 
+ * onSampleTimer() PRIVATE_SAMPLE_RATE_HZ times per second.
+ * The pulse width window in privateConfig.h is converted from milliseconds to samples.
+ */
+void initPulseSampler()
 {
-  store_IRQ_PIN( 3);
+  for ( uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
+  {
+    pulseSamplerInit( &pulseSampler[ii], PRIVATE_DEBOUNCE_SAMPLES,
+                      (uint32_t)private_min_pulse_width_ms[ii] * PRIVATE_SAMPLE_RATE_HZ / 1000,
+                      (uint32_t)private_max_pulse_width_ms[ii] * PRIVATE_SAMPLE_RATE_HZ / 1000);
+  }
+
+  sampleTimer = timerBegin(SAMPLE_TIMER, 80, true);          // APB clock 80 MHz / 80 = 1 MHz timer tick
+  timerAttachInterrupt(sampleTimer, &onSampleTimer, true);
+  timerAlarmWrite(sampleTimer, 1000000 / PRIVATE_SAMPLE_RATE_HZ, true);
+  timerAlarmEnable(sampleTimer);
 }
-void IRAM_ATTR Ext_INT5_ISR()
+
+/*
+ * ###################################################################################################
+ *                   S T O R E   I R Q    P I N  
+ * ###################################################################################################
+ */;/*
+ *  ISR handler function
+ *  The function wil receive a reference to i specific BIT in the 32 bit variable 'IRQ_PINs_stored'
+ *  and set the BIT using the  bitSet() function.
+ *  Pulses arriving within the plausibility hold-off after the previous accepted pulse are dropped and
+ *  counted in implausiblePulses[]. Other pulses are counted in rawPulses[].
+ *  The timestamp of the pulse is added to the ring buffer for the channel. If the ring buffer is full
+ *  the pulse is counted in pulseRingOverflow[] instead.
+ *  The function is also called from pollPulseCounters(), when the PCNT backend is used. As the ISR's
+ *  are not attached in that case, the ring buffers still have a single producer.
+ * 
+ * Because the function is part of the ISR functionality it is defined as IRAM_ATTR
+*/
+void IRAM_ATTR store_IRQ_PIN(u_int8_t BIT_Reference, int64_t timeStamp)
 {
-  store_IRQ_PIN( 4);
+  if ( lastPulseTime[BIT_Reference] > 0 && timeStamp - lastPulseTime[BIT_Reference] < pulseHoldOff[BIT_Reference])
+  {
+    implausiblePulses[BIT_Reference]++;
+    return;
+  }
+  lastPulseTime[BIT_Reference] = timeStamp;
+  pulseStoredAt[BIT_Reference] = esp_timer_get_time();    // timeStamp may be the rising edge of the pulse. 
+
+  // rawPulses[] and the head are updated together, so getLostPulses() never sees one without the other.
+  portENTER_CRITICAL_SAFE(&pulseRingMux);
+  rawPulses[BIT_Reference]++;
+  uint16_t head = pulseRingHead[BIT_Reference];
+  if ( (uint16_t)(head - pulseRingTail[BIT_Reference]) < PULSE_RING_SIZE)
+  {
+    pulseRing[BIT_Reference][head & (PULSE_RING_SIZE - 1)] = timeStamp;
+    pulseRingHead[BIT_Reference] = head + 1;         // Publish the slot after the timestamp has been written.
+  }
+  else
+  {
+    pulseRingOverflow[BIT_Reference]++;
+  }
+  bitSet(IRQ_PINs_stored, BIT_Reference);
+  portEXIT_CRITICAL_SAFE(&pulseRingMux);
 }
-void IRAM_ATTR Ext_INT6_ISR()
+
+/*
+ * ###################################################################################################
+ *                  N O T I F Y   P U L S E   T A S K
+ * ###################################################################################################
+ * Called by the ISR's when a pulse has been stored, to wake up the pulse task immediately.
+ * Pulses stored before the pulse task has been started are processed, when the task starts.
+*/
+void IRAM_ATTR notifyPulseTask()
 {
-  store_IRQ_PIN( 5);
+  if ( pulseTaskHandle == NULL)
+    return;
+
+  BaseType_t higherPriorityTaskWoken = pdFALSE;
+  vTaskNotifyGiveFromISR( pulseTaskHandle, &higherPriorityTaskWoken);
+  if ( higherPriorityTaskWoken)
+    portYIELD_FROM_ISR();
 }
-void IRAM_ATTR Ext_INT7_ISR()
+
+/*
+ * ###################################################################################################
+ *                  I S R    Functions
+ * ###################################################################################################
+*/;/*
+ *  Sample timer ISR - Used when PRIVATE_CAPTURE_BACKEND is CAPTURE_SAMPLER.
+ *  The input registers for all GPIO's are read once, and the level of each channel is passed to its debounce state machine.
+ *  A valid pulse is passed to the common interrupt handler function with the timestamp of the debounced rising edge.
+ *  Pulses with a width outside the window are counted in rejectedPulses[].
+*/
+void IRAM_ATTR onSampleTimer()
 {
-  store_IRQ_PIN( 6);
+  int64_t timeStamp = esp_timer_get_time();
+  uint32_t gpioIn = GPIO.in;                 // GPIO 0 - 31
+  uint32_t gpioIn1 = GPIO.in1.data;          // GPIO 32 - 39
+
+  bool pulseStored = false;
+
+  sampleCount++;
+  for ( uint8_t ii = 0; ii < PRIVATE_NO_OF_CHANNELS; ii++)
+  {
+    uint8_t pin = channelPin[ii];
+    bool level = pin < 32 ? (gpioIn >> pin) & 1 : (gpioIn1 >> (pin - 32)) & 1;
+
+    uint8_t result = pulseSamplerUpdate( &pulseSampler[ii], level, sampleCount);
+    if ( result == SAMPLER_PULSE)
+    {
+      store_IRQ_PIN( ii, timeStamp - (int64_t)(sampleCount - pulseSampler[ii].riseSample) * 1000000 / PRIVATE_SAMPLE_RATE_HZ);
+      pulseStored = true;
+    }
+    else if ( result == SAMPLER_REJECTED)
+      rejectedPulses[ii]++;
+  }
+
+  if ( pulseStored)
+    notifyPulseTask();
 }
-void IRAM_ATTR Ext_INT8_ISR()
+
+/*
+ *  IRS - One ISR is attached to all Interrupt channels. The channel number is passed as argument by attachInterruptArg().
+ *  The ISR is triggered by both edges. The rising edge is the beginning of a pulse, and the falling edge the end.
+ *  At the falling edge the pulse width is validated, and the common interrupt handler function is called with 
+ *  the timestamp of the rising edge. Pulses with a width outside the window are counted in rejectedPulses[].
+ *  A falling edge without a preceding rising edge (e.g. a spike, which has gone when the level is read) is ignored.
+ *  If the number of IRQ's within a STORM_WINDOW exceeds stormLimit[], the channel is masked. IRQ's for a masked
+ *  channel are ignored until handleInterruptStorms() has detached the interrupt.
+*/
+void IRAM_ATTR Ext_INT_ISR(void* channel)
 {
-  store_IRQ_PIN( 7);
+  uint8_t BIT_Reference = (uint8_t)(uintptr_t)channel;
+  int64_t timeStamp = esp_timer_get_time();
+
+  if ( bitRead(stormMaskedPins, BIT_Reference))
+    return;
+
+  if ( timeStamp - stormWindowStart[BIT_Reference] >= STORM_WINDOW)
+  {
+    stormWindowStart[BIT_Reference] = timeStamp;
+    stormIRQs[BIT_Reference] = 0;
+  }
+  if ( ++stormIRQs[BIT_Reference] > stormLimit[BIT_Reference])
+  {
+    portENTER_CRITICAL_ISR(&pulseRingMux);
+    bitSet(stormMaskedPins, BIT_Reference);
+    portEXIT_CRITICAL_ISR(&pulseRingMux);
+    pulseRiseTime[BIT_Reference] = 0;
+    return;
+  }
+
+  // The input registers are read directly, as gpio_get_level() is not in IRAM and the ISR may run while the cache is disabled.
+  uint8_t pin = channelPin[BIT_Reference];
+  bool level = pin < 32 ? (GPIO.in >> pin) & 1 : (GPIO.in1.data >> (pin - 32)) & 1;
+  if ( level)
+  {
+    if ( maxPulseWidth[BIT_Reference] == 0)               // Pulse width validation disabled
+    {
+      store_IRQ_PIN( BIT_Reference, timeStamp);
+      notifyPulseTask();
+    }
+    else
+      pulseRiseTime[BIT_Reference] = timeStamp;
+  } 
+  else if ( pulseRiseTime[BIT_Reference] > 0)
+  {
+    int64_t pulseWidth = timeStamp - pulseRiseTime[BIT_Reference];
+    if ( pulseWidth >= minPulseWidth[BIT_Reference] && pulseWidth <= maxPulseWidth[BIT_Reference])
+    {
+      store_IRQ_PIN( BIT_Reference, pulseRiseTime[BIT_Reference]);
+      notifyPulseTask();
+    }
+    else
+      rejectedPulses[BIT_Reference]++;
+    pulseRiseTime[BIT_Reference] = 0;
+  }
 }
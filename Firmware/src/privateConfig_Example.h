@@ -20,19 +20,66 @@ const uint16_t PRIVATE_MQTT_PORT    = 1883;     // mqtt port (default is 1883)
 
 /*
  * Define which GPIO pin numbers are used for IRQ pin / Energy Meter.
+ * The first pin in the list is channel 0, the next channel 1 and so on. Up till 24 channels can be defined.
+ * At least PRIVATE_NO_OF_CHANNELS pins must be listed.
+ * Do not use GPIO 5, 18, 19 and 23, which are used by the SD Card.
+ */
+#define PRIVATE_CHANNEL_PINS {4, 12, 13, 14, 15, 25, 26, 27}
+
+/*
+ * Select how pulses from the energy meters are captured:
+ * CAPTURE_ISR   An interrupt is triggered by every pulse. (Default)
+ * CAPTURE_PCNT  Pulses are counted in hardware by the ESP32 pulse counter (PCNT) peripheral.
+ *               Counts stay correct while WiFi, SD or HTTPS calls are blocking, and high pulse rates
+ *               (e.g. 10000 imp/kWh meters) do not cause an interrupt per pulse.
+ * CAPTURE_SAMPLER All channels are sampled PRIVATE_SAMPLE_RATE_HZ times per second by a hardware timer and debounced.
+ *               A level must be stable for PRIVATE_DEBOUNCE_SAMPLES samples to be accepted.
+ *               Fixed CPU load, also when a broken cable makes a line noisy.
+ */
+#define PRIVATE_CAPTURE_BACKEND CAPTURE_ISR
+#define PRIVATE_SAMPLE_RATE_HZ 1000
+#define PRIVATE_DEBOUNCE_SAMPLES 5
 
- * These eight GPIO's can all be configured as INPUT_PULLUP, which mens that no external componenst are required
- * Do NOT remove any of the definations! If less than eight GPIO pin's are used, keep the defination for the unused
- * GPIO's as it is.
+/*
+ * Pulses accepted by the capture layer, but never counted in the totals (e.g. lost because the pulse buffer was full),
+ * are published as "lost" in the diagnostics. Set to true to add lost pulses to the totals as well.
+ */
+#define PRIVATE_RECONCILE_LOST_PULSES false
+
+/*
+ * The published consumption is averaged over the latest PRIVATE_POWER_WINDOW pulse intervals (1 .. 16).
+ * 1 publishes the consumption calculated from the latest interval. Can be changed per energy meter through MQTT.
+ * Consumption changes smaller than PRIVATE_POWER_DEADBAND_W (Watt) are not published, but the consumption is still 
+ * published at least once a minute. 0 publishes every change.
  */
-#define private_Metr1_GPIO   4
-#define private_Metr2_GPIO   12
-#define private_Metr3_GPIO   13
-#define private_Metr4_GPIO   14
-#define private_Metr5_GPIO   15
-#define private_Metr6_GPIO   25
-#define private_Metr7_GPIO   26
-#define private_Metr8_GPIO   27
+#define PRIVATE_POWER_WINDOW 1
+#define PRIVATE_POWER_DEADBAND_W 10
+
+/*
+ * Above PRIVATE_COUNT_MODE_RATE pulses per second (e.g. 2 for a 1000 pulses per kWh energy meter at 7.2 kW) pulses 
+ * are counted over 5 seconds, and totals are written to the SD card and published once every 5 seconds instead of 
+ * for every pulse. 0 disables count mode.
+ */
+#define PRIVATE_COUNT_MODE_RATE 2
+
+/*
+ * Time of use tariffs. Every pulse is counted in the register of the tariff at the time of the pulse.
+ * private_tariffNames are the names used in the MQTT state (no spaces, no special chars), and private_tariffTable
+ * holds the tariff (index in private_tariffNames) for each hour (0 .. 23) of each weekday (Sunday first).
+ * Leave out the definitions for a single tariff.
+ */
+#define PRIVATE_NO_OF_TARIFFS 2
+const char * private_tariffNames[PRIVATE_NO_OF_TARIFFS] = {"Peak", "OffPeak"};
+uint8_t private_tariffTable[7][24] = {
+//  0  1  2  3  4  5  6  7  8  9 10 11 12 13 14 15 16 17 18 19 20 21 22 23
+  { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1},   // Sunday
+  { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, 1, 1},   // Monday
+  { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, 1, 1},   // Tuesday
+  { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, 1, 1},   // Wednesday
+  { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, 1, 1},   // Thursday
+  { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1, 1, 1},   // Friday
+  { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1},   // Saturday
+};
 
 /*
  *  Google sheets script id. 
@@ -58,6 +105,22 @@ const String PRIVATE_GOOGLE_SCRIPT_ID = "2AAU82PQwSI9opXFDJ1CNyhjA0fiJGPXuxYloCg
 
 uint16_t private_default_pulse_per_kWh[PRIVATE_NO_OF_CHANNELS] = {1000,1000,1000,1000,1000,100,100,100};
 
+// Define the accepted pulse width in milliseconds for each energy meter.
+// Pulses shorter than the minimum or longer than the maximum are rejected as noise.
+// Carlo Gavazzi EM111 and EM23 pulses are at least 30 ms wide. A maximum of 0 disables the validation for the energy meter.
+// Not used for energy meters counted by the PCNT backend. Leave out the definitions for no validation.
+
+#define PRIVATE_PULSE_WIDTH_MS
+uint16_t private_min_pulse_width_ms[PRIVATE_NO_OF_CHANNELS] = {25,25,25,25,25,25,25,25};
+uint16_t private_max_pulse_width_ms[PRIVATE_NO_OF_CHANNELS] = {150,150,150,150,150,150,150,150};
+
+// Define the maximum power in Watt for each energy meter, e.g. 17250 W for a 3 x 25 A installation.
+// Pulses arriving faster than possible at this power are dropped as implausible. 0 disables the check for the energy meter.
+// Leave out the definitions for no check.
+
+#define PRIVATE_MAX_POWER_W
+uint32_t private_max_power_W[PRIVATE_NO_OF_CHANNELS] = {17250,17250,17250,17250,17250,5750,5750,5750};
+
 char * private_energyMeters[] = {
            (char*) "Name precented in Home Assistant for energy meter connected to Metr1_GPIO",
            (char*) "Name precented in Home Assistant for energy meter connected to Metr2_GPIO",
@@ -68,3 +131,34 @@ char * private_energyMeters[] = {
            (char*) "Name precented in Home Assistant for energy meter connected to Metr7_GPIO",
            (char*) "Name precented in Home Assistant for energy meter connected to Metr8_GPIO",
 };
+
+/*
+ * Virtual meters, published to HA as energy meters after the PRIVATE_NO_OF_CHANNELS energy meters connected.
+ * The consumption and kWh of a virtual meter is the sum of the energy meters multiplied by the coefficients.
+ * The example is energy meter 0 (main meter) minus energy meters 1 and 2 (sub meters).
+ * Leave out the definitions for no virtual meters.
+ */
+#define PRIVATE_NO_OF_VIRTUAL 1
+const char * private_virtualMeters[PRIVATE_NO_OF_VIRTUAL] = {"Rest of house"};
+float private_virtualCoefficients[PRIVATE_NO_OF_VIRTUAL][PRIVATE_NO_OF_CHANNELS] = {
+  { 1, -1, -1, 0, 0, 0, 0, 0},
+};
+
+/*
+ * Sub meter reconciliation. The energy of the parent energy meter (PRIVATE_SUBMETER_PARENT) is compared with the sum of 
+ * the energy meters set to true in private_subMeterChild. An alert is raised, when the difference exceeds 
+ * PRIVATE_SUBMETER_ALERT_PERCENT of the parent (e.g. a wiring fault, a missing meter or lost pulses).
+ * Leave out the definitions for no reconciliation.
+ */
+#define PRIVATE_SUBMETER_PARENT 0
+#define PRIVATE_SUBMETER_ALERT_PERCENT 10
+bool private_subMeterChild[PRIVATE_NO_OF_CHANNELS] = {false, true, true, false, false, false, false, false};
+
+/*
+ * Step detection. Appliances switching on and off (e.g. the compressor or immersion heater of a heat pump) are detected 
+ * from the pulse intervals, and published as events. Steps smaller than private_step_min_W (Watt) are not published. 
+ * 0 disables step detection for the energy meter. Set PRIVATE_STEP_DETECTION to false, or leave out the definitions,
+ * for no step detection.
+ */
+#define PRIVATE_STEP_DETECTION true
+uint16_t private_step_min_W[PRIVATE_NO_OF_CHANNELS] = {0, 0, 0, 0, 0, 300, 0, 0};
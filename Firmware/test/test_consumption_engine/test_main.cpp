@@ -0,0 +1,136 @@
+/*
+ * ######################################################################################################################################
+ *                       T E S T   C O N S U M P T I O N   E N G I N E
+ * ######################################################################################################################################
+ *
+ * Host tests of consumptionEngine.h. The integer engine is compared with the float formula used before version 5.0.0:
+ *
+ *   round( 3600000000 / (interval + correction) / pulse_per_kWh * 1000)     // interval and correction in microseconds
+ *
+ * Run by: pio test -e native
+ */
+#include <unity.h>
+#include <math.h>
+#include <consumptionEngine.h>
+
+void setUp( void) {}
+void tearDown( void) {}
+
+/*
+ * The consumption calculated by the float formula replaced by the integer engine.
+ */
+static long floatWatt( uint16_t pulsePerkWh, int64_t interval, int64_t correction)
+{
+  return round(((float)(60LL*60*1000000) / (float)(interval + correction)) / (float)pulsePerkWh * 1000);
+}
+
+void test_watt_matches_float_formula( void)
+{
+  const uint16_t pulsePerkWh[] = {1, 10, 100, 800, 1000, 10000};
+  const int64_t correction[] = {0, 25000, -10000};
+
+  for ( uint8_t pp = 0; pp < sizeof(pulsePerkWh) / sizeof(pulsePerkWh[0]); pp++)
+  {
+    for ( uint8_t cc = 0; cc < sizeof(correction) / sizeof(correction[0]); cc++)
+    {
+      consumptionEngine_t engine;
+      consumptionEngineInit( &engine, pulsePerkWh[pp], correction[cc]);
+
+      // Intervals from 20 ms to about 3 hours, 5 % apart.
+      for ( double interval = 20000; interval < 1e10; interval *= 1.05)
+      {
+        int64_t microseconds = (int64_t)interval;
+        if ( floatWatt( pulsePerkWh[pp], microseconds, correction[cc]) > 100000)
+          continue;                                    // Above any energy meter, the float formula loses precision.
+        TEST_ASSERT_INT_WITHIN( 1, floatWatt( pulsePerkWh[pp], microseconds, correction[cc]),
+                                consumptionWatt( &engine, microseconds));
+      }
+    }
+  }
+}
+
+void test_milliwatt_is_exact( void)
+{
+  consumptionEngine_t engine;
+  consumptionEngineInit( &engine, 1000, 0);
+
+  TEST_ASSERT_EQUAL_INT64( 1000000, consumptionMilliWatt( &engine, 3600000));     // 1 Wh in 3.6 s is 1000 W
+  TEST_ASSERT_EQUAL_INT64( 1, consumptionMilliWatt( &engine, 3600000000000LL));   // 1 Wh in 1000 hours is 1 mW
+  TEST_ASSERT_EQUAL_INT64( 333333, consumptionMilliWatt( &engine, 10800000));     // Rounded to the nearest
+  TEST_ASSERT_EQUAL_INT64( 666667, consumptionMilliWatt( &engine, 5400000));
+
+  consumptionEngineInit( &engine, 1000, 400000);                                   // The correction is added to the interval
+  TEST_ASSERT_EQUAL_INT64( 1000000, consumptionMilliWatt( &engine, 3200000));
+}
+
+void test_not_configured( void)
+{
+  consumptionEngine_t engine;
+  consumptionEngineInit( &engine, 0, 0);
+  TEST_ASSERT_EQUAL_INT64( 0, consumptionMilliWatt( &engine, 3600000));
+  TEST_ASSERT_EQUAL_INT64( 0, consumptionInterval( &engine, 1000000));
+
+  consumptionEngineInit( &engine, 1000, -5000);
+  TEST_ASSERT_EQUAL_INT64( 0, consumptionMilliWatt( &engine, 5000));               // Corrected interval not positive
+  TEST_ASSERT_EQUAL_INT64( 0, consumptionInterval( &engine, 0));
+}
+
+void test_interval_is_inverse( void)
+{
+  const int64_t milliWatt[] = {1, 24999, 25000, 500000, 1000000, 17250000};
+
+  consumptionEngine_t engine;
+  consumptionEngineInit( &engine, 1000, 25000);
+  for ( uint8_t ii = 0; ii < sizeof(milliWatt) / sizeof(milliWatt[0]); ii++)
+  {
+    // The shortest interval with a consumption of at most milliWatt, before rounding: 
+    // pulsePerkWh * (interval + correction) * milliWatt >= CONSUMPTION_MWUS_PER_KWH
+    int64_t interval = consumptionInterval( &engine, milliWatt[ii]);
+    TEST_ASSERT_TRUE( 1000ULL * (interval + 25000) * milliWatt[ii] >= CONSUMPTION_MWUS_PER_KWH);
+    TEST_ASSERT_TRUE( 1000ULL * (interval - 1 + 25000) * milliWatt[ii] < CONSUMPTION_MWUS_PER_KWH);
+  }
+}
+
+void test_power_window_average( void)
+{
+  consumptionEngine_t engine;
+  consumptionEngineInit( &engine, 1000, 0);
+
+  powerWindow_t window;
+  powerWindowInit( &window, 4);
+  TEST_ASSERT_EQUAL_INT64( 0, powerWindowMilliWatt( &engine, &window));            // Empty
+
+  powerWindowAdd( &window, 3600000);                                               // 1000 W
+  TEST_ASSERT_EQUAL( 1000, powerWindowWatt( &engine, &window));
+
+  powerWindowAdd( &window, 1800000);                                               // 2000 W
+  TEST_ASSERT_EQUAL( 1333, powerWindowWatt( &engine, &window));                    // 2 Wh in 5.4 s, not the average of 1000 and 2000 W
+
+  // When full, the oldest interval is replaced.
+  for ( uint8_t ii = 0; ii < 4; ii++)
+    powerWindowAdd( &window, 7200000);                                             // 500 W
+  TEST_ASSERT_EQUAL( 4, window.count);
+  TEST_ASSERT_EQUAL_INT64( 4 * 7200000LL, window.sum);
+  TEST_ASSERT_EQUAL( 500, powerWindowWatt( &engine, &window));
+}
+
+void test_power_window_length_is_limited( void)
+{
+  powerWindow_t window;
+  powerWindowInit( &window, 0);
+  TEST_ASSERT_EQUAL( 1, window.length);
+  powerWindowInit( &window, POWER_WINDOW_MAX + 1);
+  TEST_ASSERT_EQUAL( POWER_WINDOW_MAX, window.length);
+}
+
+int main( void)
+{
+  UNITY_BEGIN();
+  RUN_TEST( test_watt_matches_float_formula);
+  RUN_TEST( test_milliwatt_is_exact);
+  RUN_TEST( test_not_configured);
+  RUN_TEST( test_interval_is_inverse);
+  RUN_TEST( test_power_window_average);
+  RUN_TEST( test_power_window_length_is_limited);
+  return UNITY_END();
+}
@@ -0,0 +1,195 @@
+/*
+ * ######################################################################################################################################
+ *                       T E S T   D E A D L I N E   Q U E U E
+ * ######################################################################################################################################
+ *
+ * Host tests of deadlineQueue.h: Pop order, changing and removing deadlines, and the heap kept consistent with
+ * position[].
+ *
+ * Run by: pio test -e native
+ */
+#include <unity.h>
+#include <deadlineQueue.h>
+
+void setUp( void) {}
+void tearDown( void) {}
+
+/*
+ * Check the heap order, and that position[] and the heap refer to each other for every channel.
+ */
+static void assertConsistent( const deadlineQueue_t* queue)
+{
+  uint8_t queued = 0;
+  for ( uint8_t channel = 0; channel < DEADLINE_QUEUE_MAX; channel++)
+  {
+    uint8_t index = queue->position[channel];
+    if ( index == DEADLINE_QUEUE_NONE)
+      continue;
+    queued++;
+    TEST_ASSERT_TRUE( index < queue->size);
+    TEST_ASSERT_EQUAL( channel, queue->channel[index]);
+  }
+  TEST_ASSERT_EQUAL( queue->size, queued);
+
+  for ( uint8_t index = 1; index < queue->size; index++)
+    TEST_ASSERT_TRUE( queue->deadline[(index - 1) / 2] <= queue->deadline[index]);
+}
+
+void test_empty( void)
+{
+  deadlineQueue_t queue;
+  deadlineQueueInit( &queue);
+  uint8_t channel = 7;
+
+  TEST_ASSERT_EQUAL_INT64( 0, deadlineQueueNext( &queue));
+  TEST_ASSERT_FALSE( deadlineQueuePop( &queue, INT64_MAX, &channel));
+  TEST_ASSERT_EQUAL( 7, channel);                                                  // Untouched
+  deadlineQueueRemove( &queue, 3);                                                 // Without a deadline
+  assertConsistent( &queue);
+}
+
+void test_pop_in_deadline_order( void)
+{
+  const int64_t deadline[] = {5000, 1000, 9000, 3000, 7000, 2000, 8000, 4000, 6000, 10000};
+
+  deadlineQueue_t queue;
+  deadlineQueueInit( &queue);
+  for ( uint8_t ii = 0; ii < sizeof(deadline) / sizeof(deadline[0]); ii++)
+    deadlineQueueSet( &queue, ii, deadline[ii]);
+  assertConsistent( &queue);
+  TEST_ASSERT_EQUAL_INT64( 1000, deadlineQueueNext( &queue));
+
+  // Nothing is due before the earliest deadline.
+  uint8_t channel;
+  TEST_ASSERT_FALSE( deadlineQueuePop( &queue, 999, &channel));
+
+  // Up to 5500 pops the deadlines 1000 to 5000, earliest first.
+  int64_t previous = 0;
+  uint8_t popped = 0;
+  while ( deadlineQueuePop( &queue, 5500, &channel))
+  {
+    TEST_ASSERT_TRUE( deadline[channel] > previous);
+    TEST_ASSERT_EQUAL( DEADLINE_QUEUE_NONE, queue.position[channel]);
+    previous = deadline[channel];
+    popped++;
+    assertConsistent( &queue);
+  }
+  TEST_ASSERT_EQUAL( 5, popped);
+  TEST_ASSERT_EQUAL_INT64( 6000, deadlineQueueNext( &queue));
+
+  while ( deadlineQueuePop( &queue, INT64_MAX, &channel))
+    popped++;
+  TEST_ASSERT_EQUAL( 10, popped);
+  TEST_ASSERT_EQUAL_INT64( 0, deadlineQueueNext( &queue));
+}
+
+void test_set_moves_existing_channel( void)
+{
+  deadlineQueue_t queue;
+  deadlineQueueInit( &queue);
+  for ( uint8_t ii = 0; ii < 8; ii++)
+    deadlineQueueSet( &queue, ii, 1000 * (ii + 1));
+
+  // Later: channel 0 is no longer the first.
+  deadlineQueueSet( &queue, 0, 8500);
+  assertConsistent( &queue);
+  TEST_ASSERT_EQUAL( 8, queue.size);
+  TEST_ASSERT_EQUAL_INT64( 2000, deadlineQueueNext( &queue));
+
+  // Earlier: channel 6 becomes the first.
+  deadlineQueueSet( &queue, 6, 500);
+  assertConsistent( &queue);
+  TEST_ASSERT_EQUAL( 8, queue.size);
+
+  const uint8_t expected[] = {6, 1, 2, 3, 4, 5, 7, 0};
+  uint8_t channel;
+  for ( uint8_t ii = 0; ii < sizeof(expected) / sizeof(expected[0]); ii++)
+  {
+    TEST_ASSERT_TRUE( deadlineQueuePop( &queue, INT64_MAX, &channel));
+    TEST_ASSERT_EQUAL( expected[ii], channel);
+  }
+  TEST_ASSERT_EQUAL( 0, queue.size);
+}
+
+void test_remove( void)
+{
+  deadlineQueue_t queue;
+  deadlineQueueInit( &queue);
+  for ( uint8_t ii = 0; ii < 10; ii++)
+    deadlineQueueSet( &queue, ii, 1000 * (ii + 1));
+
+  // The entry in the last slot: nothing to move.
+  uint8_t last = queue.channel[queue.size - 1];
+  deadlineQueueRemove( &queue, last);
+  assertConsistent( &queue);
+  TEST_ASSERT_EQUAL( 9, queue.size);
+  TEST_ASSERT_EQUAL( DEADLINE_QUEUE_NONE, queue.position[last]);
+
+  // An entry in the middle: the last entry is moved to its slot.
+  uint8_t middle = queue.channel[2];
+  deadlineQueueRemove( &queue, middle);
+  assertConsistent( &queue);
+  TEST_ASSERT_EQUAL( 8, queue.size);
+  TEST_ASSERT_EQUAL( DEADLINE_QUEUE_NONE, queue.position[middle]);
+
+  // A deadline of 0 removes the channel too, also when it is the first.
+  deadlineQueueSet( &queue, 0, 0);
+  assertConsistent( &queue);
+  TEST_ASSERT_EQUAL( 7, queue.size);
+  TEST_ASSERT_EQUAL( DEADLINE_QUEUE_NONE, queue.position[0]);
+  TEST_ASSERT_EQUAL_INT64( 2000, deadlineQueueNext( &queue));
+
+  // The remaining channels pop in order and the removed ones never.
+  int64_t previous = 0;
+  uint8_t channel;
+  while ( deadlineQueuePop( &queue, INT64_MAX, &channel))
+  {
+    TEST_ASSERT_TRUE( channel != last && channel != middle && channel != 0);
+    TEST_ASSERT_TRUE( 1000 * (channel + 1) > previous);
+    previous = 1000 * (channel + 1);
+  }
+  TEST_ASSERT_EQUAL_INT64( 0, deadlineQueueNext( &queue));
+}
+
+void test_all_channels( void)
+{
+  deadlineQueue_t queue;
+  deadlineQueueInit( &queue);
+
+  // Deadlines in a scrambled order, changed and partly removed again.
+  for ( uint8_t ii = 0; ii < DEADLINE_QUEUE_MAX; ii++)
+    deadlineQueueSet( &queue, ii, 1 + (ii * 37) % DEADLINE_QUEUE_MAX);
+  assertConsistent( &queue);
+  for ( uint8_t ii = 0; ii < DEADLINE_QUEUE_MAX; ii += 3)
+  {
+    deadlineQueueSet( &queue, ii, 1 + (ii * 11) % DEADLINE_QUEUE_MAX);
+    assertConsistent( &queue);
+  }
+  for ( uint8_t ii = 1; ii < DEADLINE_QUEUE_MAX; ii += 4)
+  {
+    deadlineQueueRemove( &queue, ii);
+    assertConsistent( &queue);
+  }
+
+  int64_t previous = 0;
+  uint8_t channel;
+  while ( deadlineQueuePop( &queue, INT64_MAX, &channel))
+  {
+    TEST_ASSERT_TRUE( channel % 4 != 1);
+    int64_t deadline = channel % 3 == 0 ? 1 + (channel * 11) % DEADLINE_QUEUE_MAX : 1 + (channel * 37) % DEADLINE_QUEUE_MAX;
+    TEST_ASSERT_TRUE( deadline >= previous);
+    previous = deadline;
+    assertConsistent( &queue);
+  }
+}
+
+int main( void)
+{
+  UNITY_BEGIN();
+  RUN_TEST( test_empty);
+  RUN_TEST( test_pop_in_deadline_order);
+  RUN_TEST( test_set_moves_existing_channel);
+  RUN_TEST( test_remove);
+  RUN_TEST( test_all_channels);
+  return UNITY_END();
+}
@@ -0,0 +1,120 @@
+/*
+ * ######################################################################################################################################
+ *                       T E S T   M I N U T E   A G G R E G A T E
+ * ######################################################################################################################################
+ *
+ * Host tests of minuteAggregate.h: Energy and average consumption from the pulses, and the minimum and maximum widened
+ * to include the average.
+ *
+ * Run by: pio test -e native
+ */
+#include <unity.h>
+#include <minuteAggregate.h>
+
+#define MINUTE 60000000LL       // Microseconds
+
+void setUp( void) {}
+void tearDown( void) {}
+
+void test_reset( void)
+{
+  minuteAggregate_t minute;
+  minuteAggregateReset( &minute);
+  minuteAggregateAddPulse( &minute);
+  minuteAggregateAddPower( &minute, 500);
+  minuteAggregateReset( &minute);
+
+  TEST_ASSERT_EQUAL( 0, minute.pulses);
+  TEST_ASSERT_EQUAL( 0, minute.samples);
+  TEST_ASSERT_EQUAL_UINT64( 0, minuteAggregateMilliWh( &minute, 1000));
+  TEST_ASSERT_EQUAL( 0, minuteAggregateAverageWatt( &minute, 1000, MINUTE));
+}
+
+void test_energy( void)
+{
+  minuteAggregate_t minute;
+  minuteAggregateReset( &minute);
+  for ( uint8_t ii = 0; ii < 125; ii++)
+    minuteAggregateAddPulse( &minute);
+
+  TEST_ASSERT_EQUAL_UINT64( 125000, minuteAggregateMilliWh( &minute, 1000));      // 1 Wh per pulse
+  TEST_ASSERT_EQUAL_UINT64( 1250000, minuteAggregateMilliWh( &minute, 100));      // 10 Wh per pulse
+  TEST_ASSERT_EQUAL_UINT64( 156250, minuteAggregateMilliWh( &minute, 800));       // 1.25 Wh per pulse
+  TEST_ASSERT_EQUAL_UINT64( 41667, minuteAggregateMilliWh( &minute, 3000));       // Rounded to the nearest
+  TEST_ASSERT_EQUAL_UINT64( 0, minuteAggregateMilliWh( &minute, 0));              // Not configured
+}
+
+void test_average( void)
+{
+  minuteAggregate_t minute;
+  minuteAggregateReset( &minute);
+  for ( uint8_t ii = 0; ii < 125; ii++)
+    minuteAggregateAddPulse( &minute);
+
+  // 125 Wh within a minute is 7500 W, no matter the consumptions added.
+  TEST_ASSERT_EQUAL( 7500, minuteAggregateAverageWatt( &minute, 1000, MINUTE));
+  minuteAggregateAddPower( &minute, 100);
+  TEST_ASSERT_EQUAL( 7500, minuteAggregateAverageWatt( &minute, 1000, MINUTE));
+
+  // A longer or shorter minute (e.g. when the time is set by NTP) gives a lower or higher average.
+  TEST_ASSERT_EQUAL( 5000, minuteAggregateAverageWatt( &minute, 1000, MINUTE * 3 / 2));
+  TEST_ASSERT_EQUAL( 15000, minuteAggregateAverageWatt( &minute, 1000, MINUTE / 2));
+
+  TEST_ASSERT_EQUAL( 0, minuteAggregateAverageWatt( &minute, 0, MINUTE));         // Not configured
+  TEST_ASSERT_EQUAL( 0, minuteAggregateAverageWatt( &minute, 1000, 0));           // No length
+}
+
+void test_average_is_rounded( void)
+{
+  minuteAggregate_t minute;
+  minuteAggregateReset( &minute);
+  minuteAggregateAddPulse( &minute);
+
+  TEST_ASSERT_EQUAL( 60, minuteAggregateAverageWatt( &minute, 1000, MINUTE));     // 1 Wh within a minute
+  TEST_ASSERT_EQUAL( 20, minuteAggregateAverageWatt( &minute, 3000, MINUTE));     // 1/3 Wh within a minute
+  TEST_ASSERT_EQUAL( 2, minuteAggregateAverageWatt( &minute, 1000, 3600000000LL * 2 / 3));   // 1.5 W rounded up
+}
+
+void test_min_max( void)
+{
+  minuteAggregate_t minute;
+  minuteAggregateReset( &minute);
+  minuteAggregateAddPower( &minute, 750);
+  minuteAggregateAddPower( &minute, 690);
+  minuteAggregateAddPower( &minute, 820);
+  minuteAggregateAddPower( &minute, 700);
+
+  TEST_ASSERT_EQUAL( 4, minute.samples);
+  TEST_ASSERT_EQUAL( 690, minuteAggregateMinWatt( &minute, 750));
+  TEST_ASSERT_EQUAL( 820, minuteAggregateMaxWatt( &minute, 750));
+}
+
+void test_min_max_widened_to_average( void)
+{
+  minuteAggregate_t minute;
+  minuteAggregateReset( &minute);
+
+  // Without any consumption added, minimum and maximum are the average.
+  TEST_ASSERT_EQUAL( 300, minuteAggregateMinWatt( &minute, 300));
+  TEST_ASSERT_EQUAL( 300, minuteAggregateMaxWatt( &minute, 300));
+
+  // The average is outside the consumptions added, e.g. when the pulses stopped within the minute.
+  minuteAggregateAddPower( &minute, 1000);
+  minuteAggregateAddPower( &minute, 1200);
+  TEST_ASSERT_EQUAL( 400, minuteAggregateMinWatt( &minute, 400));
+  TEST_ASSERT_EQUAL( 1200, minuteAggregateMaxWatt( &minute, 400));
+  TEST_ASSERT_EQUAL( 1000, minuteAggregateMinWatt( &minute, 1500));
+  TEST_ASSERT_EQUAL( 1500, minuteAggregateMaxWatt( &minute, 1500));
+}
+
+int main( void)
+{
+  UNITY_BEGIN();
+  RUN_TEST( test_reset);
+  RUN_TEST( test_energy);
+  RUN_TEST( test_average);
+  RUN_TEST( test_average_is_rounded);
+  RUN_TEST( test_min_max);
+  RUN_TEST( test_min_max_widened_to_average);
+  return UNITY_END();
+}
@@ -0,0 +1,198 @@
+/*
+ * ######################################################################################################################################
+ *                       T E S T   P U L S E   S A M P L E R
+ * ######################################################################################################################################
+ *
+ * Host tests of pulseSampler.h. Synthetic waveforms (runs of HIGH and LOW samples) are fed to pulseSamplerUpdate() to
+ * check the debouncing, the timestamp of the rising edge and the pulse width validation.
+ *
+ * Run by: pio test -e native
+ */
+#include <unity.h>
+#include <pulseSampler.h>
+
+#define THRESHOLD 5             // Samples debounce
+#define MIN_WIDTH 25            // Samples
+#define MAX_WIDTH 150           // Samples
+
+/*
+ * Results of the samples fed to the state machine.
+ */
+struct result_t
+  {
+    uint32_t pulses;            // Number of SAMPLER_PULSE
+    uint32_t rejected;          // Number of SAMPLER_REJECTED
+    uint32_t reportedAt;        // Sample count of the latest SAMPLER_PULSE or SAMPLER_REJECTED
+  };
+
+void setUp( void) {}
+void tearDown( void) {}
+
+/*
+ * Feed samples of the same level, counting sampleCount up from *sampleCount.
+ */
+static void feed( pulseSampler_t* sampler, bool level, uint32_t samples, uint32_t* sampleCount, result_t* result)
+{
+  for ( uint32_t ii = 0; ii < samples; ii++)
+  {
+    uint8_t pulse = pulseSamplerUpdate( sampler, level, *sampleCount);
+    if ( pulse == SAMPLER_PULSE)
+      result->pulses++;
+    if ( pulse == SAMPLER_REJECTED)
+      result->rejected++;
+    if ( pulse != SAMPLER_NO_PULSE)
+      result->reportedAt = *sampleCount;
+    (*sampleCount)++;
+  }
+}
+
+/*
+ * Feed a pulse of width HIGH samples followed by enough LOW samples to end it. Returns the sample count of the first
+ * HIGH sample.
+ */
+static uint32_t feedPulse( pulseSampler_t* sampler, uint32_t width, uint32_t* sampleCount, result_t* result)
+{
+  uint32_t rise = *sampleCount;
+  feed( sampler, true, width, sampleCount, result);
+  feed( sampler, false, THRESHOLD * 4, sampleCount, result);
+  return rise;
+}
+
+void test_glitches_are_ignored( void)
+{
+  pulseSampler_t sampler;
+  pulseSamplerInit( &sampler, THRESHOLD, MIN_WIDTH, MAX_WIDTH);
+  uint32_t sampleCount = 0;
+  result_t result = {};
+
+  // HIGH glitches shorter than the threshold never change the level.
+  feed( &sampler, false, 20, &sampleCount, &result);
+  for ( uint8_t ii = 0; ii < 50; ii++)
+  {
+    feed( &sampler, true, THRESHOLD - 1, &sampleCount, &result);
+    TEST_ASSERT_FALSE( sampler.level);
+    feed( &sampler, false, THRESHOLD - 1, &sampleCount, &result);
+  }
+  TEST_ASSERT_EQUAL( 0, result.pulses + result.rejected);
+
+  // LOW glitches within a pulse do not split it.
+  feed( &sampler, true, 40, &sampleCount, &result);
+  for ( uint8_t ii = 0; ii < 5; ii++)
+  {
+    feed( &sampler, false, THRESHOLD - 1, &sampleCount, &result);
+    TEST_ASSERT_TRUE( sampler.level);
+    feed( &sampler, true, THRESHOLD - 1, &sampleCount, &result);
+  }
+  feed( &sampler, false, THRESHOLD * 4, &sampleCount, &result);
+  TEST_ASSERT_EQUAL( 1, result.pulses);
+  TEST_ASSERT_EQUAL( 0, result.rejected);
+}
+
+void test_rise_sample( void)
+{
+  pulseSampler_t sampler;
+  pulseSamplerInit( &sampler, THRESHOLD, MIN_WIDTH, MAX_WIDTH);
+  uint32_t sampleCount = 1000;
+  result_t result = {};
+
+  feed( &sampler, false, 10, &sampleCount, &result);
+  uint32_t rise = sampleCount;
+  feed( &sampler, true, THRESHOLD - 1, &sampleCount, &result);
+  TEST_ASSERT_FALSE( sampler.level);
+  feed( &sampler, true, 1, &sampleCount, &result);            // The debounced rising edge
+  TEST_ASSERT_TRUE( sampler.level);
+  TEST_ASSERT_EQUAL_UINT32( rise, sampler.riseSample);        // The first HIGH sample, not the debounced edge
+
+  // A noisy beginning of the pulse delays the debounced edge, but the rise is still close to the first HIGH sample.
+  feed( &sampler, false, THRESHOLD * 4, &sampleCount, &result);
+  rise = sampleCount;
+  feed( &sampler, true, 2, &sampleCount, &result);
+  feed( &sampler, false, 1, &sampleCount, &result);
+  feed( &sampler, true, THRESHOLD, &sampleCount, &result);
+  TEST_ASSERT_TRUE( sampler.level);
+  TEST_ASSERT_EQUAL_UINT32( rise + 2, sampler.riseSample);
+}
+
+void test_pulse_width_validation( void)
+{
+  const uint32_t accepted[] = {MIN_WIDTH, 30, 100, MAX_WIDTH};
+  const uint32_t rejected[] = {THRESHOLD, MIN_WIDTH - 1, MAX_WIDTH + 1, 1000};
+
+  pulseSampler_t sampler;
+  pulseSamplerInit( &sampler, THRESHOLD, MIN_WIDTH, MAX_WIDTH);
+  uint32_t sampleCount = 0;
+  result_t result = {};
+  feed( &sampler, false, 20, &sampleCount, &result);
+
+  for ( uint8_t ii = 0; ii < sizeof(accepted) / sizeof(accepted[0]); ii++)
+  {
+    uint32_t rise = feedPulse( &sampler, accepted[ii], &sampleCount, &result);
+    TEST_ASSERT_EQUAL( ii + 1, result.pulses);
+    TEST_ASSERT_EQUAL_UINT32( rise, sampler.riseSample);
+    TEST_ASSERT_EQUAL_UINT32( rise + accepted[ii] + THRESHOLD - 1, result.reportedAt);   // Reported at the debounced falling edge
+  }
+  TEST_ASSERT_EQUAL( 0, result.rejected);
+
+  for ( uint8_t ii = 0; ii < sizeof(rejected) / sizeof(rejected[0]); ii++)
+  {
+    feedPulse( &sampler, rejected[ii], &sampleCount, &result);
+    TEST_ASSERT_EQUAL( ii + 1, result.rejected);
+  }
+  TEST_ASSERT_EQUAL( 4, result.pulses);
+}
+
+void test_validation_disabled( void)
+{
+  pulseSampler_t sampler;
+  pulseSamplerInit( &sampler, THRESHOLD, MIN_WIDTH, 0);
+  uint32_t sampleCount = 0;
+  result_t result = {};
+  feed( &sampler, false, 20, &sampleCount, &result);
+
+  // The pulse is reported at the debounced rising edge, and the falling edge reports nothing, whatever the width.
+  uint32_t rise = sampleCount;
+  feed( &sampler, true, THRESHOLD, &sampleCount, &result);
+  TEST_ASSERT_EQUAL( 1, result.pulses);
+  TEST_ASSERT_EQUAL_UINT32( rise + THRESHOLD - 1, result.reportedAt);
+  TEST_ASSERT_EQUAL_UINT32( rise, sampler.riseSample);
+  feed( &sampler, true, 1000, &sampleCount, &result);
+  feed( &sampler, false, THRESHOLD * 4, &sampleCount, &result);
+  TEST_ASSERT_EQUAL( 1, result.pulses);
+
+  feedPulse( &sampler, THRESHOLD, &sampleCount, &result);     // Shorter than MIN_WIDTH
+  TEST_ASSERT_EQUAL( 2, result.pulses);
+  TEST_ASSERT_EQUAL( 0, result.rejected);
+}
+
+void test_sample_count_wrap_around( void)
+{
+  pulseSampler_t sampler;
+  pulseSamplerInit( &sampler, THRESHOLD, MIN_WIDTH, MAX_WIDTH);
+  uint32_t sampleCount = UINT32_MAX - 60;
+  result_t result = {};
+  feed( &sampler, false, 20, &sampleCount, &result);
+
+  // The pulse begins before and ends after the sample count wraps around.
+  uint32_t rise = feedPulse( &sampler, 100, &sampleCount, &result);
+  TEST_ASSERT_EQUAL( 1, result.pulses);
+  TEST_ASSERT_EQUAL_UINT32( rise, sampler.riseSample);
+  TEST_ASSERT_TRUE( result.reportedAt < rise);                // Wrapped
+
+  // The wrap around happens within the debounce of the rising edge.
+  pulseSamplerInit( &sampler, THRESHOLD, MIN_WIDTH, MAX_WIDTH);
+  sampleCount = UINT32_MAX - 1;
+  rise = feedPulse( &sampler, MAX_WIDTH + 1, &sampleCount, &result);
+  TEST_ASSERT_EQUAL( 1, result.rejected);
+  TEST_ASSERT_EQUAL_UINT32( rise, sampler.riseSample);
+}
+
+int main( void)
+{
+  UNITY_BEGIN();
+  RUN_TEST( test_glitches_are_ignored);
+  RUN_TEST( test_rise_sample);
+  RUN_TEST( test_pulse_width_validation);
+  RUN_TEST( test_validation_disabled);
+  RUN_TEST( test_sample_count_wrap_around);
+  return UNITY_END();
+}
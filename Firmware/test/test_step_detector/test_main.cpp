@@ -0,0 +1,166 @@
+/*
+ * ######################################################################################################################################
+ *                       T E S T   S T E P   D E T E C T O R
+ * ######################################################################################################################################
+ *
+ * Host tests of stepDetector.h: Steps up and down detected with their size, and small steps and slow changes of the
+ * pulse interval not reported. The detector is set up as in main.cpp: Steps of 20 %, threshold 6 times the drift.
+ *
+ * Run by: pio test -e native
+ */
+#include <unity.h>
+#include <stepDetector.h>
+
+#define MIN_STEP_PERCENT 20
+#define THRESHOLD_FACTOR 6
+
+/*
+ * Results of the intervals fed to the detector.
+ */
+struct result_t
+  {
+    uint16_t up;                // Number of STEP_UP
+    uint16_t down;              // Number of STEP_DOWN
+    uint16_t detectedAt;        // Interval number of the latest step
+    int64_t  before;            // Typical interval before the latest step
+    int64_t  after;             // Typical interval after the latest step
+  };
+
+void setUp( void) {}
+void tearDown( void) {}
+
+/*
+ * Feed count intervals around interval with +/- noisePercent, alternating.
+ */
+static void feed( stepDetector_t* detector, int64_t interval, uint8_t noisePercent, uint16_t count, uint16_t* number, result_t* result)
+{
+  for ( uint16_t ii = 0; ii < count; ii++)
+  {
+    int64_t noise = interval * noisePercent / 100;
+    int64_t before, after;
+    uint8_t step = stepDetectorUpdate( detector, ii % 2 ? interval + noise : interval - noise, &before, &after);
+    if ( step != STEP_NONE)
+    {
+      if ( step == STEP_UP)
+        result->up++;
+      else
+        result->down++;
+      result->detectedAt = *number;
+      result->before = before;
+      result->after = after;
+    }
+    (*number)++;
+  }
+}
+
+void test_step_up( void)
+{
+  stepDetector_t detector;
+  stepDetectorInit( &detector, MIN_STEP_PERCENT, THRESHOLD_FACTOR);
+  uint16_t number = 0;
+  result_t result = {};
+
+  // An appliance of 1 kW switched on at a consumption of 1 kW: Half the interval.
+  feed( &detector, 3600000, 2, 50, &number, &result);
+  TEST_ASSERT_EQUAL( 0, result.up + result.down);
+  feed( &detector, 1800000, 2, 100, &number, &result);
+
+  TEST_ASSERT_EQUAL( 1, result.up);
+  TEST_ASSERT_EQUAL( 0, result.down);
+  TEST_ASSERT_TRUE( result.detectedAt >= 50 && result.detectedAt < 50 + 5);       // Within a few pulses
+  TEST_ASSERT_INT64_WITHIN( 3600000 / 50, 3600000, result.before);
+  TEST_ASSERT_INT64_WITHIN( 1800000 / 50, 1800000, result.after);
+}
+
+void test_step_down( void)
+{
+  stepDetector_t detector;
+  stepDetectorInit( &detector, MIN_STEP_PERCENT, THRESHOLD_FACTOR);
+  uint16_t number = 0;
+  result_t result = {};
+
+  // 3 kW to 2 kW.
+  feed( &detector, 1200000, 2, 50, &number, &result);
+  feed( &detector, 1800000, 2, 100, &number, &result);
+
+  TEST_ASSERT_EQUAL( 0, result.up);
+  TEST_ASSERT_EQUAL( 1, result.down);
+  TEST_ASSERT_TRUE( result.detectedAt >= 50 && result.detectedAt < 50 + 10);
+  TEST_ASSERT_INT64_WITHIN( 1200000 / 50, 1200000, result.before);
+  TEST_ASSERT_INT64_WITHIN( 1800000 / 50, 1800000, result.after);
+
+  // And back up again, detected from the new level.
+  feed( &detector, 1200000, 2, 100, &number, &result);
+  TEST_ASSERT_EQUAL( 1, result.up);
+  TEST_ASSERT_EQUAL( 1, result.down);
+  TEST_ASSERT_INT64_WITHIN( 1800000 / 50, 1800000, result.before);
+  TEST_ASSERT_INT64_WITHIN( 1200000 / 50, 1200000, result.after);
+}
+
+void test_small_step_not_detected( void)
+{
+  const uint8_t percent[] = {5, 8};      // Below half MIN_STEP_PERCENT (the drift) the sums never grow.
+
+  for ( uint8_t ii = 0; ii < sizeof(percent) / sizeof(percent[0]); ii++)
+  {
+    stepDetector_t detector;
+    stepDetectorInit( &detector, MIN_STEP_PERCENT, THRESHOLD_FACTOR);
+    uint16_t number = 0;
+    result_t result = {};
+
+    feed( &detector, 1000000, 0, 50, &number, &result);
+    feed( &detector, 1000000 * (100 + percent[ii]) / 100, 0, 1000, &number, &result);
+    feed( &detector, 1000000, 0, 1000, &number, &result);
+    feed( &detector, 1000000 * 100 / (100 + percent[ii]), 0, 1000, &number, &result);
+    TEST_ASSERT_EQUAL( 0, result.up + result.down);
+  }
+}
+
+void test_slow_drift_not_detected( void)
+{
+  stepDetector_t detector;
+  stepDetectorInit( &detector, MIN_STEP_PERCENT, THRESHOLD_FACTOR);
+  uint16_t number = 0;
+  result_t result = {};
+
+  // The interval grows by 0.5 % per pulse to 10 times, and shrinks back again: Far more than the minimum step in total.
+  double interval = 500000;
+  feed( &detector, (int64_t)interval, 2, 20, &number, &result);
+  while ( interval < 5000000)
+  {
+    interval *= 1.005;
+    feed( &detector, (int64_t)interval, 2, 1, &number, &result);
+  }
+  while ( interval > 500000)
+  {
+    interval /= 1.005;
+    feed( &detector, (int64_t)interval, 2, 1, &number, &result);
+  }
+  TEST_ASSERT_TRUE( number > 900);
+  TEST_ASSERT_EQUAL( 0, result.up + result.down);
+}
+
+void test_invalid_interval_ignored( void)
+{
+  stepDetector_t detector;
+  stepDetectorInit( &detector, MIN_STEP_PERCENT, THRESHOLD_FACTOR);
+  uint16_t number = 0;
+  result_t result = {};
+
+  feed( &detector, 1000000, 0, 20, &number, &result);
+  feed( &detector, 0, 0, 20, &number, &result);
+  feed( &detector, -1000000, 0, 20, &number, &result);
+  feed( &detector, 1000000, 0, 20, &number, &result);
+  TEST_ASSERT_EQUAL( 0, result.up + result.down);
+}
+
+int main( void)
+{
+  UNITY_BEGIN();
+  RUN_TEST( test_step_up);
+  RUN_TEST( test_step_down);
+  RUN_TEST( test_small_step_not_detected);
+  RUN_TEST( test_slow_drift_not_detected);
+  RUN_TEST( test_invalid_interval_ignored);
+  return UNITY_END();
+}